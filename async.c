@@ -0,0 +1,460 @@
+#define _GNU_SOURCE 1
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "async.h"
+#include "buf.h"
+#include "debug.h"
+
+DECLARE_CHANNEL(async);
+
+enum Backpressure { BP_BLOCK=0, BP_DROP, BP_SPILL };
+
+/* an operation waiting in a worker's queue. */
+struct qitem {
+  struct fpfile* file;
+  struct fpop op; /* op.buf is meaningless while queued, unless op.ref */
+  size_t off; /* where the op's data lives in the ring */
+  size_t len; /* bytes of ring the data uses; 0 if it's not in the ring */
+  size_t waste; /* ring bytes skipped at the end to make the data fit */
+  off_t spill; /* where the data lives in the spill file, or -1 */
+};
+
+/* Each worker owns a queue of operations and a ring of bytes holding their
+ * data.  Both are bounded.  Data is released in the order it was added, since
+ * the worker runs operations in order, so the ring is just a circular buffer
+ * between 'tail' (oldest data) and 'head' (where new data goes). */
+#define QSLOTS 1024U
+struct worker {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t nonempty; /* signalled when an item is queued */
+  pthread_cond_t room; /* signalled when an item finishes */
+  struct qitem items[QSLOTS];
+  size_t first; /* index of the oldest item */
+  size_t count; /* number of items queued */
+  bool busy; /* running an item right now */
+  bool stop; /* finish what is queued, then exit */
+  char* ring;
+  size_t cap; /* size of 'ring' */
+  size_t head, tail, used;
+  int spillfd; /* created the first time we need it */
+  off_t spillend;
+  size_t spillpending; /* items whose data is in the spill file */
+  void* scratch; /* spilled data is read back into this */
+  size_t nscratch;
+  struct asyncstats stats;
+};
+static struct worker* workers = NULL;
+static size_t nworkers = 0;
+/* the workers' counters, kept when they are shut down. */
+static struct asyncstats final;
+static enum Backpressure policy = BP_BLOCK;
+static const size_t DEFAULT_QUEUE = 64U*1024U*1024U;
+
+bool
+async_enabled()
+{
+  return nworkers > 0;
+}
+
+/* finds room for 'n' bytes of data in the ring. */
+static bool
+ring_alloc(struct worker* w, size_t n, size_t* off, size_t* waste)
+{
+  const bool wrapped = w->head < w->tail ||
+                       (w->head == w->tail && w->used > 0);
+  *waste = 0;
+  if(!wrapped && w->cap - w->head >= n) {
+    *off = w->head;
+  } else if(!wrapped && n <= w->tail) { /* doesn't fit at the end; wrap. */
+    *waste = w->cap - w->head;
+    *off = 0;
+  } else if(wrapped && w->tail - w->head >= n) {
+    *off = w->head;
+  } else {
+    return false;
+  }
+  w->head = *off + n;
+  w->used += n + *waste;
+  return true;
+}
+
+/* releases the ring data of the oldest item.  items without data in the ring
+ * (other operations, spilled and referenced writes) hold no space, and must
+ * not move the tail: a wrapped ring may still have data queued after it. */
+static void
+ring_free(struct worker* w, const struct qitem* it)
+{
+  if(it->len == 0) {
+    return;
+  }
+  w->tail = it->off + it->len;
+  w->used -= it->len + it->waste;
+  if(w->used == 0) {
+    w->head = w->tail = 0;
+  }
+}
+
+/* a gather list is stored contiguously; the worker hands processors a single
+ * buffer for it. */
+static void
+gather(char* to, const struct fpop* op)
+{
+  if(op->iov == NULL) {
+    memcpy(to, op->buf, op->n);
+    return;
+  }
+  for(int i=0; i < op->iovcnt; ++i) {
+    memcpy(to, op->iov[i].iov_base, op->iov[i].iov_len);
+    to += op->iov[i].iov_len;
+  }
+}
+
+static bool
+spill_bytes(struct worker* w, const void* buf, size_t n, off_t off)
+{
+  for(size_t done=0; done < n; ) {
+    const ssize_t b = pwrite(w->spillfd, (const char*)buf+done, n-done,
+                             off+(off_t)done);
+    if(b == -1 && errno == EINTR) { continue; }
+    if(b <= 0) {
+      ERR(async, "error spilling %zu bytes: %d", n, errno);
+      return false;
+    }
+    done += (size_t)b;
+  }
+  return true;
+}
+
+/* appends the op's data to the spill file.  @returns its offset, or -1. */
+static off_t
+spill(struct worker* w, const struct fpop* op)
+{
+  if(w->spillfd == -1) {
+    const char* tmp = getenv("TMPDIR");
+    char fn[512];
+    snprintf(fn, 512, "%s/libsitu-spill-XXXXXX", tmp ? tmp : "/tmp");
+    w->spillfd = mkstemp(fn);
+    if(w->spillfd == -1) {
+      ERR(async, "could not create spill file %s: %d", fn, errno);
+      return -1;
+    }
+    unlink(fn); /* goes away when we close it. */
+  }
+  const off_t off = w->spillend;
+  const struct iovec one = { (void*)op->buf, op->n };
+  const struct iovec* iov = op->iov ? op->iov : &one;
+  const int cnt = op->iov ? op->iovcnt : 1;
+  off_t at = off;
+  for(int i=0; i < cnt; ++i) {
+    if(!spill_bytes(w, iov[i].iov_base, iov[i].iov_len, at)) {
+      return -1;
+    }
+    at += (off_t)iov[i].iov_len;
+  }
+  w->spillend = at;
+  return off;
+}
+
+static const void*
+unspill(struct worker* w, off_t off, size_t n)
+{
+  if(w->nscratch < n) {
+    void* mem = realloc(w->scratch, n);
+    if(mem == NULL) {
+      ERR(async, "could not allocate %zu bytes to read spilled data", n);
+      return NULL;
+    }
+    w->scratch = mem;
+    w->nscratch = n;
+  }
+  for(size_t done=0; done < n; ) {
+    const ssize_t b = pread(w->spillfd, (char*)w->scratch+done, n-done,
+                            off+(off_t)done);
+    if(b == -1 && errno == EINTR) { continue; }
+    if(b <= 0) {
+      ERR(async, "error reading back %zu spilled bytes: %d", n, errno);
+      return NULL;
+    }
+    done += (size_t)b;
+  }
+  return w->scratch;
+}
+
+static void*
+work(void* arg)
+{
+  struct worker* w = arg;
+  pthread_mutex_lock(&w->lock);
+  for(;;) {
+    while(w->count == 0 && !w->stop) {
+      pthread_cond_wait(&w->nonempty, &w->lock);
+    }
+    if(w->count == 0) { /* told to stop, and nothing left. */
+      break;
+    }
+    const struct qitem it = w->items[w->first];
+    w->busy = true;
+    pthread_mutex_unlock(&w->lock);
+
+    /* the item's data can't move while we use it: the ring is only freed
+     * from here, and new data goes elsewhere. */
+    struct fpop op = it.op;
+    if(it.len > 0) {
+      op.buf = w->ring + it.off;
+    } else if(it.spill != -1) {
+      op.buf = unspill(w, it.spill, op.n);
+    }
+    if(op.kind != FPOP_STREAM || op.buf != NULL || op.n == 0) {
+      fpfile_apply(it.file, &op);
+    }
+    if(op.ref) {
+      fpbuf_unref(op.ref);
+    }
+
+    pthread_mutex_lock(&w->lock);
+    w->first = (w->first + 1) % QSLOTS;
+    w->count--;
+    ring_free(w, &it);
+    if(it.spill != -1 && --w->spillpending == 0) {
+      /* caught up with the spill; start over at the beginning. */
+      w->spillend = 0;
+      if(ftruncate(w->spillfd, 0) != 0) {
+        WARN(async, "could not truncate spill file: %d", errno);
+      }
+    }
+    w->busy = false;
+    w->stats.depth = w->count;
+    w->stats.bytes = w->used;
+    pthread_cond_broadcast(&w->room);
+  }
+  pthread_mutex_unlock(&w->lock);
+  return NULL;
+}
+
+void
+async_submit(struct fpfile* f, const struct fpop* op)
+{
+  assert(nworkers > 0);
+  struct worker* w = &workers[f->worker % nworkers];
+  /* referenced data is a snapshot; it needs no room in the ring. */
+  const size_t n = op->kind == FPOP_STREAM && op->ref == NULL ? op->n : 0;
+  struct qitem it = { f, *op, 0, 0, 0, -1 };
+
+  pthread_mutex_lock(&w->lock);
+  w->stats.submitted++;
+  if(n > w->cap && policy != BP_SPILL) { /* this will never fit. */
+    if(policy == BP_DROP) {
+      w->stats.dropped++;
+      pthread_mutex_unlock(&w->lock);
+      return;
+    }
+    /* wait until the worker is idle and run it ourselves.  nothing else of
+     * this file is queued then, so it is still in order. */
+    while(w->count > 0 || w->busy) {
+      w->stats.blocked++;
+      pthread_cond_wait(&w->room, &w->lock);
+    }
+    pthread_mutex_unlock(&w->lock);
+    fpfile_apply(f, op);
+    return;
+  }
+  for(;;) {
+    if(w->count < QSLOTS) {
+      if(n == 0 || ring_alloc(w, n, &it.off, &it.waste)) {
+        it.len = n;
+        break;
+      }
+      if(policy == BP_SPILL) {
+        if((it.spill = spill(w, op)) != -1) {
+          w->spillpending++;
+          w->stats.spilled++;
+          break;
+        }
+        /* couldn't spill; fall back to waiting. */
+      }
+    }
+    /* full.  operations other than writes are never dropped: processors rely
+     * on seeing 'finish', for example. */
+    if(policy == BP_DROP && op->kind == FPOP_STREAM) {
+      w->stats.dropped++;
+      pthread_mutex_unlock(&w->lock);
+      return;
+    }
+    w->stats.blocked++;
+    pthread_cond_wait(&w->room, &w->lock);
+  }
+  if(it.len > 0) {
+    gather(w->ring + it.off, op);
+  }
+  if(it.op.ref) {
+    fpbuf_ref(it.op.ref);
+  } else {
+    it.op.buf = NULL;
+  }
+  it.op.iov = NULL;
+  it.op.iovcnt = 0;
+  w->items[(w->first + w->count) % QSLOTS] = it;
+  w->count++;
+  w->stats.depth = w->count;
+  w->stats.bytes = w->used;
+  if(w->count > w->stats.maxdepth) { w->stats.maxdepth = w->count; }
+  if(w->used > w->stats.maxbytes) { w->stats.maxbytes = w->used; }
+  pthread_cond_signal(&w->nonempty);
+  pthread_mutex_unlock(&w->lock);
+}
+
+void
+async_stats(struct asyncstats* st)
+{
+  if(nworkers == 0) { /* after a shutdown, what the workers had done. */
+    *st = final;
+    return;
+  }
+  memset(st, 0, sizeof(struct asyncstats));
+  for(size_t i=0; i < nworkers; ++i) {
+    struct worker* w = &workers[i];
+    pthread_mutex_lock(&w->lock);
+    st->depth += w->stats.depth;
+    st->maxdepth += w->stats.maxdepth;
+    st->bytes += w->stats.bytes;
+    st->maxbytes += w->stats.maxbytes;
+    st->submitted += w->stats.submitted;
+    st->blocked += w->stats.blocked;
+    st->dropped += w->stats.dropped;
+    st->spilled += w->stats.spilled;
+    pthread_mutex_unlock(&w->lock);
+  }
+}
+
+/* threads do not survive a fork.  the child just processes synchronously. */
+static void
+forked_child()
+{
+  nworkers = 0;
+  memset(&final, 0, sizeof(final));
+}
+
+static size_t
+parse_size(const char* var, size_t dflt)
+{
+  const char* s = getenv(var);
+  if(s == NULL) {
+    return dflt;
+  }
+  errno = 0;
+  char* end;
+  const unsigned long long v = strtoull(s, &end, 10);
+  if(errno != 0 || end == s) {
+    WARN(async, "could not parse %s='%s'; using %zu", var, s, dflt);
+    return dflt;
+  }
+  return (size_t)v;
+}
+
+void
+async_init()
+{
+  const size_t n = parse_size("LIBSITU_ASYNC", 0);
+  if(n == 0) {
+    return;
+  }
+  const size_t queue = parse_size("LIBSITU_ASYNC_QUEUE", DEFAULT_QUEUE);
+  const char* pol = getenv("LIBSITU_ASYNC_POLICY");
+  if(pol == NULL || strcmp(pol, "block") == 0) {
+    policy = BP_BLOCK;
+  } else if(strcmp(pol, "drop") == 0) {
+    policy = BP_DROP;
+  } else if(strcmp(pol, "spill") == 0) {
+    policy = BP_SPILL;
+  } else {
+    WARN(async, "unknown policy '%s'; blocking instead.", pol);
+    policy = BP_BLOCK;
+  }
+
+  struct worker* ws = calloc(n, sizeof(struct worker));
+  if(ws == NULL) {
+    ERR(async, "could not allocate %zu workers; staying synchronous.", n);
+    return;
+  }
+  /* our threads shouldn't be the ones to receive the simulation's signals. */
+  sigset_t all, old;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  size_t started = 0;
+  for(; started < n; ++started) {
+    struct worker* w = &ws[started];
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->nonempty, NULL);
+    pthread_cond_init(&w->room, NULL);
+    w->spillfd = -1;
+    w->cap = queue;
+    w->ring = malloc(queue);
+    if(w->ring == NULL && queue > 0) {
+      ERR(async, "could not allocate %zu-byte queue", queue);
+      break;
+    }
+    if(pthread_create(&w->thread, NULL, work, w) != 0) {
+      ERR(async, "could not create worker %zu: %d", started, errno);
+      free(w->ring);
+      break;
+    }
+  }
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  if(started == 0) {
+    free(ws);
+    return;
+  }
+  workers = ws;
+  nworkers = started;
+  pthread_atfork(NULL, NULL, forked_child);
+  TRACE(async, "%zu workers with %zu-byte queues, policy '%s'", nworkers,
+        queue, pol ? pol : "block");
+}
+
+void
+async_shutdown()
+{
+  const size_t n = nworkers;
+  if(n == 0) {
+    return;
+  }
+  for(size_t i=0; i < n; ++i) {
+    struct worker* w = &workers[i];
+    pthread_mutex_lock(&w->lock);
+    w->stop = true;
+    pthread_cond_signal(&w->nonempty);
+    pthread_mutex_unlock(&w->lock);
+    pthread_join(w->thread, NULL);
+  }
+  struct asyncstats st;
+  async_stats(&st);
+  final = st;
+  nworkers = 0; /* anything from here on is synchronous. */
+  TRACE(async, "%zu ops; max depth %zu, max %zu bytes; blocked %zu times; "
+        "%zu spilled", st.submitted, st.maxdepth, st.maxbytes, st.blocked,
+        st.spilled);
+  if(st.dropped > 0) {
+    WARN(async, "dropped %zu writes because processing fell behind.",
+         st.dropped);
+  }
+  for(size_t i=0; i < n; ++i) {
+    struct worker* w = &workers[i];
+    free(w->ring);
+    free(w->scratch);
+    if(w->spillfd != -1) {
+      close(w->spillfd);
+    }
+    pthread_mutex_destroy(&w->lock);
+    pthread_cond_destroy(&w->nonempty);
+    pthread_cond_destroy(&w->room);
+  }
+  free(workers);
+  workers = NULL;
+}
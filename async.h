@@ -0,0 +1,44 @@
+/* Asynchronous processing.  Normally a processor runs inside the simulation's
+ * write, so a slow processor stalls the simulation.  In asynchronous mode we
+ * instead copy the data into a bounded queue, return to the simulation right
+ * away, and have worker threads run the processors.  Each file is handled by
+ * a single worker, so a processor still sees a file's calls in order.
+ *
+ * Configured via the environment:
+ *   LIBSITU_ASYNC: number of worker threads.  Unset or 0 means synchronous.
+ *   LIBSITU_ASYNC_QUEUE: bytes of write data each worker may have queued.
+ *                        Default 64 MiB.
+ *   LIBSITU_ASYNC_POLICY: what to do when a queue is full:
+ *     "block": wait for the worker to catch up.  The default.
+ *     "drop": throw the write away; processors won't see it.
+ *     "spill": put the data in a temporary file, to be read back later. */
+#ifndef FREEPROC_ASYNC_H
+#define FREEPROC_ASYNC_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "fproc.h"
+
+/* starts the workers, if the environment asks for them. */
+void async_init();
+/* runs everything that is still queued, then stops the workers. */
+void async_shutdown();
+bool async_enabled();
+/* queues the operation for the file's worker.  The operation's buffer is
+ * copied; the caller is free to reuse it once this returns. */
+void async_submit(struct fpfile*, const struct fpop*);
+
+struct asyncstats {
+  size_t depth; /* operations queued right now */
+  size_t maxdepth; /* most operations that were ever queued at once */
+  size_t bytes; /* bytes of data queued right now */
+  size_t maxbytes; /* most bytes that were ever queued at once */
+  size_t submitted; /* operations ever queued */
+  size_t blocked; /* times a submitter had to wait for room */
+  size_t dropped; /* writes we threw away */
+  size_t spilled; /* writes we sent to the spill file */
+};
+/* sums the counters over all workers. */
+void async_stats(struct asyncstats*);
+
+#endif
@@ -0,0 +1,100 @@
+/* Checks that asynchronous processing hands processors exactly the bytes that
+ * were written.  A small queue and writes of assorted sizes make the ring wrap
+ * often; a metadata call after every third write puts items without any ring
+ * data between them.  Every write gets its own byte pattern, and the processor
+ * checks each byte it sees.  The processor is deliberately slow, so the queue
+ * stays full.
+ *
+ *   ./asynctest [nwrites] */
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "async.h"
+#include "fproc.h"
+
+static struct teelib tlibs[MAX_FREEPROCS];
+
+static size_t
+wsize(size_t w)
+{
+  return 100 + (w*37) % 900;
+}
+
+static size_t seen = 0; /* writes the processor received */
+static size_t nmeta = 0;
+static size_t bad = 0;
+
+static void
+check(const char* fn, const void* buf, size_t n)
+{
+  (void)fn;
+  const size_t w = seen++;
+  const unsigned char* b = buf;
+  if(n != wsize(w)) {
+    fprintf(stderr, "write %zu: %zu bytes, expected %zu\n", w, n, wsize(w));
+    ++bad;
+    return;
+  }
+  for(size_t i=0; i < n; ++i) {
+    if(b[i] != (unsigned char)(w*7 + i)) {
+      fprintf(stderr, "write %zu: byte %zu is %u, expected %u\n", w, i,
+              (unsigned)b[i], (unsigned)(unsigned char)(w*7 + i));
+      ++bad;
+      return;
+    }
+  }
+  if(w % 16 == 0) {
+    const struct timespec pause = { 0, 100000 };
+    nanosleep(&pause, NULL);
+  }
+}
+
+static void
+meta(const char* fn, const size_t dims[3], int type)
+{
+  (void)fn; (void)dims; (void)type;
+  ++nmeta;
+}
+
+int
+main(int argc, char* argv[])
+{
+  const size_t nwrites = argc > 1 ? strtoul(argv[1], NULL, 10) : 100000;
+  setenv("LIBSITU_ASYNC", "1", 1);
+  setenv("LIBSITU_ASYNC_QUEUE", "4096", 1);
+  async_init();
+  if(!async_enabled()) {
+    fprintf(stderr, "asynchronous processing didn't start\n");
+    return EXIT_FAILURE;
+  }
+  tlibs[0].pattern = strdup("*");
+  tlibs[0].transfer = check;
+  tlibs[0].metadata = meta;
+  compile_pattern(&tlibs[0]);
+  struct fpfile* f = fpfile_open(tlibs, "asynctest.raw");
+
+  unsigned char buf[1024];
+  const size_t dims[3] = { 4, 4, 4 };
+  for(size_t w=0; w < nwrites; ++w) {
+    for(size_t i=0; i < wsize(w); ++i) {
+      buf[i] = (unsigned char)(w*7 + i);
+    }
+    fpfile_stream(f, buf, wsize(w));
+    if(w % 3 == 2) {
+      fpfile_metadata(f, dims, FP_FLOAT32);
+    }
+  }
+  fpfile_close(f);
+  async_shutdown();
+  free(tlibs[0].pattern);
+
+  if(seen != nwrites || nmeta != nwrites/3) {
+    fprintf(stderr, "saw %zu writes and %zu metadata, expected %zu and %zu\n",
+            seen, nmeta, nwrites, nwrites/3);
+    ++bad;
+  }
+  printf("%zu writes, %zu corrupt\n", seen, bad);
+  return bad == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
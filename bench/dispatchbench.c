@@ -0,0 +1,102 @@
+/* Measures the cost of dispatching a write to the freeprocessors: one file
+ * receives many small writes while 32 patterns are loaded, only some of which
+ * match.  Three ways of dispatching are compared:
+ *   fnmatch: every write fnmatch(3)es the filename against every pattern,
+ *            which is what 'stream' used to do;
+ *   stream: 'stream', i.e. every write re-matches with compiled patterns;
+ *   fpfile: matching happens once, and every write walks the list.
+ *
+ *   ./dispatchbench 10000000 */
+#define _POSIX_C_SOURCE 200809L
+#include <fnmatch.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "fproc.h"
+
+static const char* patterns[] = {
+  "header.txt", "*.h5", "*.vtk", "*.silo", "*Restart*", "psi*.dat", "*slice*",
+  "Temp.*", "*[0-9].nrrd", "output-????", "*.csv", "*checkpoint*", "rho*",
+  "*.bov", "*.raw", "*.nhdr", "*.xdmf", "*.log", "DD[0-9]*/*", "*.hdf", "*.cgns",
+  "*.exo", "*.vti", "plt*", "*.bin", "*.dump", "enzo*", "*.xmf", "restart*",
+  "*.pvd", "field-*", "*",
+};
+#define NPATTERNS (sizeof(patterns) / sizeof(patterns[0]))
+static struct teelib tlibs[MAX_FREEPROCS];
+
+static size_t seen = 0;
+static void
+count(const char* fn, const void* buf, size_t n)
+{
+  (void)fn; (void)buf;
+  seen += n;
+}
+
+static double
+now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+report(const char* what, size_t nwrites, double elapsed)
+{
+  printf("%-8s %zu writes in %.3fs: %6.1f ns/write\n", what, nwrites, elapsed,
+         elapsed/nwrites*1e9);
+}
+
+int
+main(int argc, char* argv[])
+{
+  const size_t nwrites = argc > 1 ? strtoul(argv[1], NULL, 10) : 10000000;
+  const char* fn = "data/RestartFile.Rank0042.dat";
+  for(size_t i=0; i < NPATTERNS; ++i) {
+    tlibs[i].pattern = strdup(patterns[i]);
+    tlibs[i].transfer = count;
+    compile_pattern(&tlibs[i]);
+  }
+  const char buf[8] = {0};
+
+  double start = now();
+  for(size_t w=0; w < nwrites; ++w) {
+    for(size_t i=0; i < MAX_FREEPROCS && tlibs[i].pattern; ++i) {
+      if(fnmatch(tlibs[i].pattern, fn, 0) == 0) {
+        tlibs[i].transfer(fn, buf, sizeof(buf));
+      }
+    }
+  }
+  report("fnmatch", nwrites, now()-start);
+  const size_t expected = seen;
+
+  seen = 0;
+  start = now();
+  for(size_t w=0; w < nwrites; ++w) {
+    stream(tlibs, fn, buf, sizeof(buf));
+  }
+  report("stream", nwrites, now()-start);
+  if(seen != expected) {
+    fprintf(stderr, "stream saw %zu bytes, fnmatch saw %zu!\n", seen, expected);
+    return EXIT_FAILURE;
+  }
+
+  seen = 0;
+  start = now();
+  struct fpfile* f = fpfile_open(tlibs, fn);
+  for(size_t w=0; w < nwrites; ++w) {
+    fpfile_stream(f, buf, sizeof(buf));
+  }
+  fpfile_close(f);
+  report("fpfile", nwrites, now()-start);
+  if(seen != expected) {
+    fprintf(stderr, "fpfile saw %zu bytes, fnmatch saw %zu!\n", seen, expected);
+    return EXIT_FAILURE;
+  }
+
+  for(size_t i=0; i < NPATTERNS; ++i) {
+    free(tlibs[i].pattern);
+  }
+  return EXIT_SUCCESS;
+}
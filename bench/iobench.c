@@ -0,0 +1,248 @@
+/* A synthetic writer for measuring what the symbiont costs a simulation.  It
+ * times every call individually and reports throughput plus latency
+ * percentiles as one JSON object per run:
+ *
+ *   ./iobench [-o results.jsonl] api bytes count [key=value ...]
+ *
+ * 'api' is one of write, fwrite, pwrite or h5 (H5Dwrite of a 1-D dataset of
+ * doubles, if we were built with HDF5).  Every call writes 'bytes' bytes to
+ * the start of 'iobench.out' (or 'iobench.h5'), so the file doesn't grow.
+ * Extra key=value pairs are copied into the output verbatim (so values must
+ * be valid JSON); the driver script uses them to label runs.  Run it outside
+ * /tmp: the symbiont ignores files there. */
+#define _POSIX_C_SOURCE 200809L
+#include <fcntl.h>
+#include <inttypes.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "config.h"
+#ifdef HAVE_HDF5
+# include <hdf5.h>
+#endif
+
+static uint64_t
+now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec*1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/* A log-linear latency histogram: each power of two is split into SUB
+ * buckets, so any recorded value is within 1/SUB of its bucket's bound. */
+#define SUB_BITS 4U
+#define SUB (1U << SUB_BITS)
+#define NBUCKETS (64U * SUB)
+static uint64_t hist[NBUCKETS];
+
+static unsigned
+bucket(uint64_t ns)
+{
+  if(ns < SUB) {
+    return (unsigned)ns;
+  }
+  const unsigned msb = 63U - (unsigned)__builtin_clzll(ns);
+  const unsigned shift = msb - SUB_BITS;
+  return (shift+1)*SUB + (unsigned)((ns >> shift) & (SUB-1));
+}
+
+/* the largest value that lands in bucket 'b'. */
+static uint64_t
+bucket_max(unsigned b)
+{
+  if(b < SUB) {
+    return b;
+  }
+  const unsigned shift = b/SUB - 1;
+  const uint64_t lo = ((uint64_t)(SUB + b%SUB)) << shift;
+  return lo + ((1ULL << shift) - 1);
+}
+
+static uint64_t
+percentile(uint64_t total, double p)
+{
+  const uint64_t rank = (uint64_t)ceil(p * (double)total);
+  uint64_t seen = 0;
+  for(unsigned b=0; b < NBUCKETS; ++b) {
+    seen += hist[b];
+    if(seen >= rank && seen > 0) {
+      return bucket_max(b);
+    }
+  }
+  return 0;
+}
+
+enum API { API_WRITE=0, API_FWRITE, API_PWRITE, API_H5 };
+static const char* apis[] = { "write", "fwrite", "pwrite", "h5" };
+
+struct target {
+  int fd;
+  FILE* fp;
+#ifdef HAVE_HDF5
+  hid_t h5file, dset;
+#endif
+};
+
+static bool
+setup(enum API api, size_t bytes, struct target* t)
+{
+  switch(api) {
+    case API_WRITE:
+    case API_PWRITE:
+      t->fd = open("iobench.out", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      return t->fd != -1;
+    case API_FWRITE:
+      t->fp = fopen("iobench.out", "w");
+      return t->fp != NULL;
+    case API_H5: {
+#ifdef HAVE_HDF5
+      const hsize_t dims[1] = { bytes / sizeof(double) };
+      t->h5file = H5Fcreate("iobench.h5", H5F_ACC_TRUNC, H5P_DEFAULT,
+                            H5P_DEFAULT);
+      const hid_t space = H5Screate_simple(1, dims, NULL);
+      t->dset = H5Dcreate2(t->h5file, "data", H5T_NATIVE_DOUBLE, space,
+                           H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+      H5Sclose(space);
+      return t->h5file >= 0 && t->dset >= 0;
+#else
+      (void)bytes;
+      fprintf(stderr, "built without HDF5\n");
+      return false;
+#endif
+    }
+  }
+  return false;
+}
+
+/* one timed call. */
+static bool
+once(enum API api, const struct target* t, const void* buf, size_t bytes)
+{
+  switch(api) {
+    case API_WRITE: return write(t->fd, buf, bytes) == (ssize_t)bytes;
+    case API_FWRITE: return fwrite(buf, 1, bytes, t->fp) == bytes;
+    case API_PWRITE: return pwrite(t->fd, buf, bytes, 0) == (ssize_t)bytes;
+    case API_H5:
+#ifdef HAVE_HDF5
+      return H5Dwrite(t->dset, H5T_NATIVE_DOUBLE, H5S_ALL, H5S_ALL,
+                      H5P_DEFAULT, buf) >= 0;
+#else
+      return false;
+#endif
+  }
+  return false;
+}
+
+/* back to the start of the file; not timed. */
+static void
+rewind_target(enum API api, const struct target* t)
+{
+  if(api == API_WRITE) {
+    lseek(t->fd, 0, SEEK_SET);
+  } else if(api == API_FWRITE) {
+    fseek(t->fp, 0, SEEK_SET);
+  }
+}
+
+static void
+teardown(enum API api, struct target* t)
+{
+  switch(api) {
+    case API_WRITE: case API_PWRITE: close(t->fd); break;
+    case API_FWRITE: fclose(t->fp); break;
+    case API_H5:
+#ifdef HAVE_HDF5
+      H5Dclose(t->dset);
+      H5Fclose(t->h5file);
+#endif
+      break;
+  }
+}
+
+int
+main(int argc, char* argv[])
+{
+  FILE* out = stdout;
+  int a = 1;
+  if(argc > 2 && strcmp(argv[1], "-o") == 0) {
+    out = fopen(argv[2], "a");
+    if(out == NULL) {
+      fprintf(stderr, "could not open %s\n", argv[2]);
+      return EXIT_FAILURE;
+    }
+    a = 3;
+  }
+  if(argc - a < 3) {
+    fprintf(stderr, "usage: %s [-o file] write|fwrite|pwrite|h5 bytes count "
+            "[key=value ...]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+  enum API api = API_WRITE;
+  while(api <= API_H5 && strcmp(apis[api], argv[a]) != 0) { ++api; }
+  if(api > API_H5) {
+    fprintf(stderr, "unknown api '%s'\n", argv[a]);
+    return EXIT_FAILURE;
+  }
+  size_t bytes = strtoul(argv[a+1], NULL, 10);
+  const size_t count = strtoul(argv[a+2], NULL, 10);
+  if(api == API_H5) { /* whole doubles. */
+    bytes = bytes < sizeof(double) ? sizeof(double) :
+                                     bytes / sizeof(double) * sizeof(double);
+  }
+  char* buf = malloc(bytes);
+  if(buf == NULL || count == 0) {
+    fprintf(stderr, "bad size or count\n");
+    return EXIT_FAILURE;
+  }
+  for(size_t i=0; i < bytes; ++i) {
+    buf[i] = (char)i;
+  }
+
+  struct target t;
+  memset(&t, 0, sizeof(struct target));
+  if(!setup(api, bytes, &t)) {
+    fprintf(stderr, "could not set up %s target\n", apis[api]);
+    return EXIT_FAILURE;
+  }
+  uint64_t total = 0, worst = 0;
+  for(size_t i=0; i < count; ++i) {
+    rewind_target(api, &t);
+    const uint64_t start = now_ns();
+    const bool ok = once(api, &t, buf, bytes);
+    const uint64_t ns = now_ns() - start;
+    if(!ok) {
+      fprintf(stderr, "%s %zu failed\n", apis[api], i);
+      return EXIT_FAILURE;
+    }
+    hist[bucket(ns)]++;
+    total += ns;
+    worst = ns > worst ? ns : worst;
+  }
+  teardown(api, &t);
+  free(buf);
+
+  fprintf(out, "{\"api\": \"%s\", \"bytes\": %zu, \"count\": %zu",
+          apis[api], bytes, count);
+  for(int i=a+3; i < argc; ++i) {
+    const char* eq = strchr(argv[i], '=');
+    if(eq == NULL) { continue; }
+    fprintf(out, ", \"%.*s\": %s", (int)(eq-argv[i]), argv[i], eq+1);
+  }
+  const double secs = total / 1e9;
+  fprintf(out, ", \"seconds\": %.6f, \"MBps\": %.2f, \"mean_ns\": %.1f, "
+          "\"p50_ns\": %" PRIu64 ", \"p99_ns\": %" PRIu64 ", "
+          "\"p999_ns\": %" PRIu64 ", \"max_ns\": %" PRIu64 "}\n",
+          secs, secs > 0 ? bytes*(double)count / secs / 1e6 : 0.0,
+          (double)total / count, percentile(count, 0.5),
+          percentile(count, 0.99), percentile(count, 0.999), worst);
+  if(out != stdout) {
+    fclose(out);
+  }
+  return EXIT_SUCCESS;
+}
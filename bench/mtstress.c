@@ -0,0 +1,123 @@
+/* Stress test for the symbiont's thread safety.  Many threads concurrently
+ * open, write and close many files, through both the POSIX and stdio paths,
+ * interleaved with writes to a descriptor nobody tracks.  Each thread keeps
+ * all of its files open at once, so that together they push the descriptor
+ * table past its initial size and make it grow while others are writing.
+ *
+ * Pair it with the 'stressproc' freeprocessor, which checks that every byte
+ * was attributed to the right file:
+ *
+ *   echo 'stress-* { exec: ./.libs/stressproc.so }' > situ.cfg
+ *   LD_PRELOAD=./.libs/libsitu.so ./mtstress 16 128 1000 */
+#define _POSIX_C_SOURCE 200809L
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+static size_t nfiles = 64;
+static size_t nwrites = 1000;
+static int devnull = -1;
+
+struct stressfile {
+  char name[64];
+  int fd;
+  FILE* fp;
+};
+
+static void*
+writer(void* arg)
+{
+  const size_t t = (size_t)arg;
+  const size_t bsize = 64 + t % 7; /* vary sizes a bit across threads. */
+  char* buf = malloc(bsize);
+  struct stressfile* f = calloc(nfiles, sizeof(struct stressfile));
+  if(buf == NULL || f == NULL) {
+    fprintf(stderr, "[%zu] out of memory\n", t);
+    exit(EXIT_FAILURE);
+  }
+  memset(buf, (int)t, bsize);
+  for(size_t i=0; i < nfiles; ++i) {
+    snprintf(f[i].name, sizeof(f[i].name), "stress-%zu-%zu-%zu", t, i,
+             bsize*nwrites);
+    if(i % 2 == 0) {
+      f[i].fd = open(f[i].name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      f[i].fp = NULL;
+    } else {
+      f[i].fd = -1;
+      f[i].fp = fopen(f[i].name, "wb");
+    }
+    if(f[i].fd == -1 && f[i].fp == NULL) {
+      fprintf(stderr, "[%zu] could not create %s\n", t, f[i].name);
+      exit(EXIT_FAILURE);
+    }
+  }
+  for(size_t w=0; w < nwrites; ++w) {
+    for(size_t i=0; i < nfiles; ++i) {
+      if(f[i].fp) {
+        if(fwrite(buf, 1, bsize, f[i].fp) != bsize) {
+          fprintf(stderr, "[%zu] short fwrite to %s\n", t, f[i].name);
+          exit(EXIT_FAILURE);
+        }
+      } else if(write(f[i].fd, buf, bsize) != (ssize_t)bsize) {
+        fprintf(stderr, "[%zu] short write to %s\n", t, f[i].name);
+        exit(EXIT_FAILURE);
+      }
+      if(write(devnull, buf, 1) != 1) {
+        fprintf(stderr, "[%zu] write to /dev/null failed\n", t);
+        exit(EXIT_FAILURE);
+      }
+    }
+  }
+  for(size_t i=0; i < nfiles; ++i) {
+    if(f[i].fp) {
+      fclose(f[i].fp);
+    } else {
+      close(f[i].fd);
+    }
+    unlink(f[i].name);
+  }
+  free(f);
+  free(buf);
+  return NULL;
+}
+
+int
+main(int argc, char* argv[])
+{
+  const size_t nthreads = argc > 1 ? strtoul(argv[1], NULL, 10) : 8;
+  nfiles = argc > 2 ? strtoul(argv[2], NULL, 10) : nfiles;
+  nwrites = argc > 3 ? strtoul(argv[3], NULL, 10) : nwrites;
+
+  /* make room for everybody's files at once. */
+  struct rlimit lim;
+  if(getrlimit(RLIMIT_NOFILE, &lim) == 0) {
+    const rlim_t want = nthreads*nfiles + 64;
+    lim.rlim_cur = want < lim.rlim_max ? want : lim.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &lim);
+  }
+  devnull = open("/dev/null", O_WRONLY);
+
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  pthread_t* threads = calloc(nthreads, sizeof(pthread_t));
+  for(size_t t=0; t < nthreads; ++t) {
+    if(pthread_create(&threads[t], NULL, writer, (void*)t) != 0) {
+      fprintf(stderr, "could not create thread %zu\n", t);
+      return EXIT_FAILURE;
+    }
+  }
+  for(size_t t=0; t < nthreads; ++t) {
+    pthread_join(threads[t], NULL);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  free(threads);
+  close(devnull);
+  printf("%zu threads x %zu files x %zu writes in %.3fs\n", nthreads, nfiles,
+         nwrites, (end.tv_sec-start.tv_sec) + (end.tv_nsec-start.tv_nsec)/1e9);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,64 @@
+#!/bin/sh
+# Runs iobench over a matrix of APIs, buffer sizes and processor setups, with
+# and without the symbiont preloaded, and prints the results as a JSON array.
+# Run from the build directory:
+#
+#   sh bench/overhead.sh > overhead.json
+#
+# Processor setups are "procs" copies of the minmax processor that all match
+# the output file, plus "patterns" patterns that never match it.  The
+# processors print, so their stdout is discarded; results go via a file.
+# Set IOBENCH_BYTES to a byte budget per run (default 256 MiB) to trade
+# precision for time.
+build=$(pwd)
+iobench="$build/iobench"
+libsitu="$build/.libs/libsitu.so"
+minmax="$build/.libs/minmax.so"
+budget=${IOBENCH_BYTES:-268435456}
+for f in "$iobench" "$libsitu" "$minmax"; do
+  [ -e "$f" ] || { echo "missing $f; run 'make' first." >&2; exit 1; }
+done
+apis="write fwrite pwrite"
+"$iobench" h5 8 1 >/dev/null 2>&1 && apis="$apis h5"
+rm -f iobench.h5
+
+work=$(mktemp -d "$build/iobench.XXXXXX")
+trap 'rm -rf "$work"' EXIT
+results="$work/results.jsonl"
+cd "$work"
+
+# writes situ.cfg for 'procs' matching processors and 'patterns' others.
+config() {
+  : > situ.cfg
+  i=0
+  while [ $i -lt "$2" ]; do
+    echo "nomatch$i-* { exec: $minmax }" >> situ.cfg
+    i=$((i+1))
+  done
+  i=0
+  while [ $i -lt "$1" ]; do
+    echo "iobench* { exec: $minmax }" >> situ.cfg
+    i=$((i+1))
+  done
+}
+
+for api in $apis; do
+  for bytes in 64 65536 16777216; do
+    count=$((budget / bytes))
+    [ $count -gt 100000 ] && count=100000
+    [ $count -lt 16 ] && count=16
+    "$iobench" -o "$results" $api $bytes $count preload=false procs=0 \
+      patterns=0 >/dev/null || echo "$api $bytes failed" >&2
+    for setup in "0 0" "0 64" "1 0" "4 0" "16 0" "4 64"; do
+      set -- $setup
+      config $1 $2
+      LD_PRELOAD="$libsitu" "$iobench" -o "$results" $api $bytes $count \
+        preload=true procs=$1 patterns=$2 >/dev/null 2>&1 ||
+        echo "$api $bytes failed with the symbiont ($setup)" >&2
+    done
+  done
+done
+
+echo "["
+sed '$!s/$/,/' "$results"
+echo "]"
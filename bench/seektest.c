@@ -0,0 +1,51 @@
+/* Writes a few files with seeks and positioned writes in between; run under
+ * the symbiont with 'offsetproc', see seektest.sh.  Appends must be reported
+ * at an unknown offset (-1) however the program seeks, since that is where
+ * the data goes. */
+#define _POSIX_C_SOURCE 200809L
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+static void
+put(int fd, const char* s, size_t n)
+{
+  if(write(fd, s, n) != (ssize_t)n) {
+    perror("write");
+    exit(EXIT_FAILURE);
+  }
+}
+
+static void
+pput(int fd, const char* s, size_t n, off_t off)
+{
+  if(pwrite(fd, s, n, off) != (ssize_t)n) {
+    perror("pwrite");
+    exit(EXIT_FAILURE);
+  }
+}
+
+int
+main()
+{
+  int fd = open("seek-plain", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if(fd == -1) { perror("seek-plain"); return EXIT_FAILURE; }
+  put(fd, "abcd", 4);
+  lseek(fd, 0, SEEK_SET);
+  put(fd, "ef", 2);
+  lseek(fd, 10, SEEK_SET);
+  put(fd, "ghi", 3);
+  pput(fd, "jk", 2, 1);
+  put(fd, "l", 1);
+  close(fd);
+
+  fd = open("seek-append", O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+  if(fd == -1) { perror("seek-append"); return EXIT_FAILURE; }
+  put(fd, "abcd", 4);
+  lseek(fd, 0, SEEK_SET);
+  put(fd, "ef", 2);
+  pput(fd, "gh", 2, 1);
+  close(fd);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,25 @@
+#!/bin/sh
+# Checks the offsets processors are given for writes after seeks, positioned
+# writes, and writes to files opened for appending.  Run from the build
+# directory; 'make check' does.
+build=$(pwd)
+for f in "$build/seektest" "$build/.libs/libsitu.so" \
+         "$build/.libs/offsetproc.so"; do
+  [ -e "$f" ] || { echo "missing $f; run 'make' first." >&2; exit 1; }
+done
+work=$(mktemp -d "$build/seektest.XXXXXX")
+trap 'rm -rf "$work"' EXIT
+cd "$work"
+echo "seek-* { exec: $build/.libs/offsetproc.so }" > situ.cfg
+LD_PRELOAD="$build/.libs/libsitu.so" "$build/seektest" || exit 1
+cat > expected.log <<END
+seek-plain 0 4
+seek-plain 0 2
+seek-plain 10 3
+seek-plain 1 2
+seek-plain 13 1
+seek-append -1 4
+seek-append -1 2
+seek-append -1 2
+END
+diff -u expected.log offsets.log
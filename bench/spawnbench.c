@@ -0,0 +1,79 @@
+/* Measures what it costs to start a consumer from a process with a large
+ * heap, as a simulation would: with fork and exec, the way the launchers used
+ * to, and with spawn (see spawner.h).  Each child is /bin/true; we wait for it
+ * before starting the next, so the time includes the child's exit.
+ *
+ *   ./spawnbench [heap MiB] [launches]
+ *   ./spawnbench 4096 50 */
+#define _GNU_SOURCE 1
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include "spawner.h"
+
+static double
+now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static pid_t
+forkexec(char* const argv[], char* const env[])
+{
+  const pid_t pid = fork();
+  if(pid == 0) {
+    execve(argv[0], argv, env);
+    _exit(127);
+  }
+  return pid;
+}
+
+static void
+report(const char* what, size_t heap, size_t n, double elapsed)
+{
+  printf("%-10s %6zu MiB heap: %zu launches in %.3fs: %8.1f us/launch\n",
+         what, heap, n, elapsed, elapsed/n*1e6);
+}
+
+int
+main(int argc, char* argv[])
+{
+  const size_t mib = argc > 1 ? strtoul(argv[1], NULL, 10) : 1024;
+  const size_t n = argc > 2 ? strtoul(argv[2], NULL, 10) : 50;
+  /* touch every page, so it is really mapped and fork has to copy the
+   * tables for it. */
+  char* heap = malloc(mib << 20);
+  if(heap == NULL && mib > 0) {
+    fprintf(stderr, "could not allocate %zu MiB\n", mib);
+    return EXIT_FAILURE;
+  }
+  for(size_t i=0; i < (mib << 20); i += 4096) {
+    heap[i] = (char)i;
+  }
+  char* child[] = { "/bin/true", NULL };
+  char** env = minimal_env(NULL);
+
+  for(int method=0; method < 2; ++method) {
+    const double t0 = now();
+    for(size_t i=0; i < n; ++i) {
+      const pid_t pid = method == 0 ? forkexec(child, env) :
+                                      spawn(child, env, false);
+      int status;
+      if(pid == -1 || waitpid(pid, &status, 0) != pid ||
+         !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "launch %zu failed\n", i);
+        return EXIT_FAILURE;
+      }
+    }
+    report(method == 0 ? "fork+exec" : "spawn", mib, n, now()-t0);
+  }
+  free_env(env);
+  free(heap);
+  return EXIT_SUCCESS;
+}
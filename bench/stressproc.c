@@ -0,0 +1,80 @@
+/* The freeprocessor half of 'mtstress'.  It tallies the bytes it sees for each
+ * file, and when the file is finished compares the tally against the size the
+ * file was supposed to have; the stress test encodes that in the filename:
+ * "stress-THREAD-FILE-BYTES".  It also checks each write's bytes, which
+ * mtstress sets to the thread's id.  Any mismatch means the symbiont lost,
+ * misattributed or corrupted a write. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define MAX_THREADS 64U
+#define MAX_FILES 512U
+static size_t seen[MAX_THREADS][MAX_FILES];
+static size_t verified = 0;
+static size_t mismatched = 0;
+static size_t corrupt = 0; /* writes whose bytes weren't what was written */
+
+static size_t*
+tally(const char* fn, size_t* expected)
+{
+  unsigned t, f;
+  if(sscanf(fn, "stress-%u-%u-%zu", &t, &f, expected) != 3 ||
+     t >= MAX_THREADS || f >= MAX_FILES) {
+    fprintf(stderr, "stressproc: unexpected file '%s'\n", fn);
+    __atomic_add_fetch(&mismatched, 1, __ATOMIC_RELAXED);
+    return NULL;
+  }
+  return &seen[t][f];
+}
+
+void
+exec(const char* fn, const void* buf, size_t n)
+{
+  size_t expected;
+  size_t* count = tally(fn, &expected);
+  if(count == NULL) {
+    return;
+  }
+  __atomic_add_fetch(count, n, __ATOMIC_RELAXED);
+  /* mtstress fills every buffer with the writing thread's id. */
+  unsigned t;
+  sscanf(fn, "stress-%u", &t);
+  const unsigned char* b = buf;
+  for(size_t i=0; i < n; ++i) {
+    if(b[i] != (unsigned char)t) {
+      fprintf(stderr, "stressproc: %s: byte %zu of a %zu-byte write is %u, "
+              "expected %u\n", fn, i, n, (unsigned)b[i], t & 0xffU);
+      __atomic_add_fetch(&corrupt, 1, __ATOMIC_RELAXED);
+      return;
+    }
+  }
+}
+
+void
+finish(const char* fn)
+{
+  size_t expected;
+  size_t* count = tally(fn, &expected);
+  if(count == NULL) {
+    return;
+  }
+  const size_t got = __atomic_exchange_n(count, 0, __ATOMIC_RELAXED);
+  if(got != expected) {
+    fprintf(stderr, "stressproc: %s: saw %zu bytes, expected %zu\n", fn, got,
+            expected);
+    __atomic_add_fetch(&mismatched, 1, __ATOMIC_RELAXED);
+  } else {
+    __atomic_add_fetch(&verified, 1, __ATOMIC_RELAXED);
+  }
+}
+
+__attribute__((destructor)) static void
+report()
+{
+  fprintf(stderr, "stressproc: %zu files verified, %zu mismatched, "
+          "%zu corrupt writes\n", verified, mismatched, corrupt);
+  if(mismatched > 0 || corrupt > 0) {
+    _exit(EXIT_FAILURE);
+  }
+}
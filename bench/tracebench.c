@@ -0,0 +1,69 @@
+/* Measures what a disabled TRACE costs on a hot path such as 'write'.  Three
+ * ways of expanding one are compared, each with the channel disabled:
+ *   call:    calling into symb_dbg, which checks the channel; this is what
+ *            TRACE used to expand to;
+ *   inline:  TRACE as it is now: the check is inlined, and the call and the
+ *            evaluation of its arguments are skipped;
+ *   floor:   TRACE compiled out with -DSITU_MIN_LEVEL=warn or higher.
+ *
+ *   ./tracebench 100000000 */
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "debug.h"
+
+DECLARE_CHANNEL(bench);
+
+static double
+now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+report(const char* what, size_t n, double elapsed)
+{
+  printf("%-8s %zu traces in %.3fs: %6.2f ns/trace\n", what, n, elapsed,
+         elapsed/n*1e9);
+}
+
+int
+main(int argc, char* argv[])
+{
+  const size_t n = argc > 1 ? strtoul(argv[1], NULL, 10) : 100000000;
+  /* the arguments a typical write-path trace has: a size, a descriptor and a
+   * name that takes a little work to produce. */
+  const char* name = "data/RestartFile.Rank0042.dat";
+  volatile size_t sink = 0;
+  /* make sure it's off, whatever LIBSITU_DEBUG says. */
+  symb_parse_options(&symb_chn_bench, "bench=-trace");
+
+  double start = now();
+  for(size_t i=0; i < n; ++i) {
+    symb_dbg(SymbiontTrace, &symb_chn_bench, __FUNCTION__,
+             "writing %zu bytes to %d (%zu-char name)", i, 3, strlen(name+i%4));
+    sink += i;
+  }
+  report("call", n, now()-start);
+
+  start = now();
+  for(size_t i=0; i < n; ++i) {
+    TRACE(bench, "writing %zu bytes to %d (%zu-char name)", i, 3,
+          strlen(name+i%4));
+    sink += i;
+  }
+  report("inline", n, now()-start);
+
+  start = now();
+  for(size_t i=0; i < n; ++i) {
+    SYMB_NODBG(SymbiontTrace, bench, "writing %zu bytes to %d (%zu-char name)",
+               i, 3, strlen(name+i%4));
+    sink += i;
+  }
+  report("floor", n, now()-start);
+  return sink == 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,66 @@
+/* Checks the binary trace format: trace_parse on a few formats here, and,
+ * with tracetest.sh, what 'situtrace' makes of the records we write.  A
+ * forked child traces as well, to see it kept apart from its parent. */
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "debug.h"
+#include "trace.h"
+
+DECLARE_CHANNEL(tt);
+
+static const struct {
+  const char* fmt;
+  unsigned n;
+  unsigned char kinds[TRACE_NARGS];
+} cases[] = {
+  { "%*d", 2, { TA_WIDTH, TA_INT } },
+  { "%.*s", 2, { TA_WIDTH, TA_STR } },
+  { "%-*.*f", 3, { TA_WIDTH, TA_WIDTH, TA_DOUBLE } },
+  { "%zu", 1, { TA_SIZE } },
+  { "%p", 1, { TA_PTR } },
+  { "%%", 0, { 0 } },
+  { "%d%% of %zu at %p", 3, { TA_INT, TA_SIZE, TA_PTR } },
+  { "%lld %ld %hhx %jd %td %Lg %c", 7,
+    { TA_LLONG, TA_LONG, TA_INT, TA_INTMAX, TA_PTRDIFF, TA_LDOUBLE } },
+};
+
+int
+main()
+{
+  size_t bad = 0;
+  for(size_t i=0; i < sizeof(cases)/sizeof(cases[0]); ++i) {
+    unsigned char kinds[TRACE_NARGS];
+    const unsigned n = trace_parse(cases[i].fmt, kinds);
+    const unsigned want = cases[i].n < TRACE_NARGS ? cases[i].n : TRACE_NARGS;
+    if(n != want || memcmp(kinds, cases[i].kinds, n) != 0) {
+      fprintf(stderr, "trace_parse(\"%s\"): %u arguments, expected %u\n",
+              cases[i].fmt, n, want);
+      ++bad;
+    }
+  }
+  if(!trace_on()) {
+    fprintf(stderr, "LIBSITU_TRACE is not set; only trace_parse checked.\n");
+    return bad == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+  symb_parse_options(&symb_chn_tt, "tt=+trace");
+  TRACE(tt, "width %*d|", 5, 42);
+  TRACE(tt, "prec %.*s|", 3, "abcdef");
+  TRACE(tt, "size %zu|", (size_t)17);
+  TRACE(tt, "ptr %p|", (void*)0x1234);
+  TRACE(tt, "pct 100%%|");
+  const pid_t pid = fork();
+  if(pid == 0) {
+    TRACE(tt, "child %d|", 7);
+    _exit(EXIT_SUCCESS);
+  }
+  int status;
+  if(pid == -1 || waitpid(pid, &status, 0) != pid || status != 0) {
+    fprintf(stderr, "the child failed\n");
+    ++bad;
+  }
+  return bad == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
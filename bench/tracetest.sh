@@ -0,0 +1,38 @@
+#!/bin/sh
+# Records a few traces with 'tracetest' and checks what 'situtrace' makes of
+# them.  Run from the build directory; 'make check' does.
+build=$(pwd)
+for f in "$build/tracetest" "$build/situtrace"; do
+  [ -e "$f" ] || { echo "missing $f; run 'make' first." >&2; exit 1; }
+done
+work=$(mktemp -d "$build/tracetest.XXXXXX")
+trap 'rm -rf "$work"' EXIT
+LIBSITU_TRACE="$work/tt" OMPI_COMM_WORLD_RANK=3 "$build/tracetest" || exit 1
+"$build/situtrace" "$work"/tt.*.trc > "$work/timeline.json" || exit 1
+status=0
+for msg in 'width    42|' 'prec abc|' 'size 17|' 'ptr 0x1234|' 'pct 100%|' \
+           'child 7|'; do
+  if ! grep -qF "\"msg\": \"$msg\"" "$work/timeline.json"; then
+    echo "no message '$msg' in the timeline" >&2
+    status=1
+  fi
+done
+# the child has the rank too, but must be a process of its own.
+pidof() {
+  grep -F "$1" "$work/timeline.json" | sed 's/.*"pid": \([0-9]*\),.*/\1/'
+}
+parent=$(pidof '"msg": "width')
+child=$(pidof '"msg": "child')
+if [ -z "$parent" ] || [ "$parent" = "$child" ]; then
+  echo "the child's events are in its parent's row ($parent)" >&2
+  status=1
+fi
+names=$(grep -c '"process_name".*"rank 3, pid' "$work/timeline.json")
+forked=$(grep -c "\"process_name\".*\"rank 3, pid $child, forked from $parent\"" \
+         "$work/timeline.json")
+if [ "$names" != 2 ] || [ "$forked" != 1 ]; then
+  echo "expected two processes named for rank 3, one forked:" >&2
+  grep process_name "$work/timeline.json" >&2
+  status=1
+fi
+exit $status
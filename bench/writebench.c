@@ -0,0 +1,44 @@
+/* Measures the per-call cost of 'write' on a descriptor the symbiont does not
+ * track.  Run it once plainly and once with the symbiont preloaded; the
+ * difference is the interposition overhead every untracked write pays:
+ *
+ *   ./writebench 10000000
+ *   LD_PRELOAD=./.libs/libsitu.so ./writebench 10000000 */
+#define _POSIX_C_SOURCE 200112L
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+static double
+now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int
+main(int argc, char* argv[])
+{
+  const size_t n = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+  const int fd = open("/dev/null", O_WRONLY);
+  if(fd == -1) {
+    fprintf(stderr, "could not open /dev/null\n");
+    return EXIT_FAILURE;
+  }
+  const char byte = 42;
+  const double start = now();
+  for(size_t i=0; i < n; ++i) {
+    if(write(fd, &byte, 1) != 1) {
+      fprintf(stderr, "write %zu failed\n", i);
+      close(fd);
+      return EXIT_FAILURE;
+    }
+  }
+  const double elapsed = now() - start;
+  close(fd);
+  printf("%zu writes in %.3fs: %.1f ns/write\n", n, elapsed, elapsed/n*1e9);
+  return EXIT_SUCCESS;
+}
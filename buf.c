@@ -0,0 +1,172 @@
+#define _GNU_SOURCE 1
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "buf.h"
+#include "debug.h"
+#include "idmap.h"
+
+DECLARE_CHANNEL(buf);
+
+/* the buffer the processors on this thread are looking at, if any. */
+static __thread const struct fpbuf* current = NULL;
+/* buffers processors retained, keyed on their data pointer.  Retains and
+ * releases are rare compared to writes, so one lock for all reference counts
+ * is fine. */
+static struct idmap retained = IDMAP_INITIALIZER;
+static pthread_mutex_t refs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+const struct fpbuf*
+fpbuf_current(const struct fpbuf* b)
+{
+  const struct fpbuf* prev = current;
+  current = b;
+  return prev;
+}
+
+struct fpbuf*
+fpbuf_map(int fd, off_t off, size_t n)
+{
+  const long pgsize = sysconf(_SC_PAGESIZE);
+  if(n == 0 || off < 0 || pgsize <= 0) {
+    return NULL;
+  }
+  const size_t delta = (size_t)(off % pgsize);
+  struct fpbuf* b = calloc(1, sizeof(struct fpbuf));
+  if(b == NULL) {
+    return NULL;
+  }
+  b->len = n + delta;
+  b->base = mmap(NULL, b->len, PROT_READ, MAP_SHARED, fd, off-(off_t)delta);
+  if(b->base == MAP_FAILED) {
+    TRACE(buf, "could not map %zu bytes at %lld: %d", n, (long long)off,
+          errno);
+    free(b);
+    return NULL;
+  }
+  b->data = (const char*)b->base + delta;
+  b->n = n;
+  b->kind = FPBUF_MAPPED;
+  b->refs = 1;
+  return b;
+}
+
+void
+fpbuf_ref(struct fpbuf* b)
+{
+  pthread_mutex_lock(&refs_lock);
+  b->refs++;
+  pthread_mutex_unlock(&refs_lock);
+}
+
+/* refs_lock must be held. */
+static bool
+unref_locked(struct fpbuf* b)
+{
+  if(--b->refs > 0) {
+    return false;
+  }
+  idmap_del(&retained, (uintptr_t)b->data);
+  return true;
+}
+
+static void
+destroy(struct fpbuf* b)
+{
+  if(b->kind == FPBUF_MAPPED) {
+    munmap(b->base, b->len);
+  } else if(b->kind == FPBUF_HEAP) {
+    free(b->base);
+  }
+  free(b);
+}
+
+void
+fpbuf_unref(struct fpbuf* b)
+{
+  pthread_mutex_lock(&refs_lock);
+  const bool dead = unref_locked(b);
+  pthread_mutex_unlock(&refs_lock);
+  if(dead) {
+    destroy(b);
+  }
+}
+
+const void*
+fpbuf_retain(const void* buf)
+{
+  if(buf == NULL) {
+    return NULL;
+  }
+  pthread_mutex_lock(&refs_lock);
+  struct fpbuf* b = idmap_get(&retained, (uintptr_t)buf);
+  if(b != NULL) {
+    b->refs++;
+    pthread_mutex_unlock(&refs_lock);
+    return b->data;
+  }
+  const struct fpbuf* cur = current;
+  size_t n = cur ? cur->n : 0;
+  bool found = cur != NULL && cur->iov == NULL && cur->data == buf;
+  for(int i=0; cur != NULL && i < cur->iovcnt && !found; ++i) {
+    found = cur->iov[i].iov_base == buf;
+    n = cur->iov[i].iov_len;
+  }
+  if(!found) {
+    pthread_mutex_unlock(&refs_lock);
+    WARN(buf, "retaining %p, which is not the buffer given to 'exec'", buf);
+    return NULL;
+  }
+  if(cur->kind == FPBUF_MAPPED) { /* nothing can change it; share it. */
+    b = (struct fpbuf*)cur;
+    b->refs++;
+  } else {
+    b = calloc(1, sizeof(struct fpbuf));
+    void* mem = b ? malloc(n ? n : 1) : NULL;
+    if(mem == NULL) {
+      free(b);
+      pthread_mutex_unlock(&refs_lock);
+      ERR(buf, "out of memory copying %zu-byte buffer", n);
+      return NULL;
+    }
+    memcpy(mem, buf, n);
+    b->base = mem;
+    b->len = b->n = n;
+    b->data = mem;
+    b->kind = FPBUF_HEAP;
+    b->refs = 1;
+  }
+  if(!idmap_put(&retained, (uintptr_t)b->data, b)) {
+    const bool dead = unref_locked(b);
+    pthread_mutex_unlock(&refs_lock);
+    if(dead) {
+      destroy(b);
+    }
+    ERR(buf, "out of memory tracking retained buffer");
+    return NULL;
+  }
+  pthread_mutex_unlock(&refs_lock);
+  return b->data;
+}
+
+void
+fpbuf_release(const void* buf)
+{
+  pthread_mutex_lock(&refs_lock);
+  struct fpbuf* b = idmap_get(&retained, (uintptr_t)buf);
+  if(b == NULL) {
+    pthread_mutex_unlock(&refs_lock);
+    WARN(buf, "releasing %p, which was never retained", buf);
+    return;
+  }
+  const bool dead = unref_locked(b);
+  pthread_mutex_unlock(&refs_lock);
+  if(dead) {
+    destroy(b);
+  }
+}
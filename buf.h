@@ -0,0 +1,51 @@
+/* Lifetime of the data given to processors.  Normally the buffer a processor's
+ * 'exec' receives is only valid until 'exec' returns: it is the simulation's
+ * own buffer, or a queue slot that is reused right afterwards.  A processor
+ * that wants to keep the data around longer calls 'fpbuf_retain' on it and
+ * uses the pointer that returns until it calls 'fpbuf_release'.
+ *
+ * Retaining is cheap when the data is already a snapshot nobody else will
+ * change: large writes in asynchronous mode are handed over as a read-only
+ * mapping of the file's own pages (see LIBSITU_ZEROCOPY in posix.c), and
+ * retaining one of those only bumps a reference count.  Otherwise retaining
+ * makes a copy.  For a gather list, each entry is retained on its own. */
+#ifndef FREEPROC_BUF_H
+#define FREEPROC_BUF_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/** for processors.  'buf' must be the pointer given to 'exec' (during that
+ * call), or one that was previously returned from here.
+ * @returns the pointer to use until the matching release, or NULL if 'buf' is
+ * not one of ours or we ran out of memory. */
+const void* fpbuf_retain(const void* buf);
+void fpbuf_release(const void* buf);
+
+enum FPBufKind {
+  FPBUF_BORROWED=0, /* somebody else's memory; only valid for now */
+  FPBUF_HEAP, /* our copy; freed with the last reference */
+  FPBUF_MAPPED, /* a mapping of file pages; unmapped with the last reference */
+};
+struct fpbuf {
+  const void* data;
+  size_t n;
+  enum FPBufKind kind;
+  unsigned refs;
+  void* base; /* what to free or unmap */
+  size_t len; /* ... and how much of it */
+  const struct iovec* iov; /* BORROWED: a gather list, instead of 'data' */
+  int iovcnt;
+};
+
+/** maps 'n' bytes of 'fd', starting at 'off', read-only.  The file must have
+ * been opened for reading.  @returns NULL on error.  Holds one reference. */
+struct fpbuf* fpbuf_map(int fd, off_t off, size_t n);
+void fpbuf_ref(struct fpbuf*);
+void fpbuf_unref(struct fpbuf*);
+/** makes 'b' the buffer processors on this thread are currently seeing, which
+ * is what 'fpbuf_retain' checks against.  @returns the previous one. */
+const struct fpbuf* fpbuf_current(const struct fpbuf* b);
+
+#endif
@@ -7,6 +7,7 @@
 #include <sys/types.h>
 #include <unistd.h>
 #include "debug.h"
+#include "trace.h"
 
 static long pid = -1;
 static bool color_enabled = false;
@@ -51,18 +52,48 @@ color(const enum SymbiontChanClass cls)
   return C_NORM;
 }
 
+static void
+vprint(enum SymbiontChanClass type, const char* func, const char* format,
+       va_list args)
+{
+  const char* fixit = type==SymbiontFixme ? "-FIXME" : "";
+  printf("%s[%ld](%s%s) ", color(type), pid, func, fixit);
+  (void) vprintf(format, args);
+  printf("%s\n", color_enabled ? C_NORM : "");
+}
+
 void
 symb_dbg(enum SymbiontChanClass type, const struct symbdbgchannel* channel,
          const char* func, const char* format, ...)
+{
+  if(!dbgchannel_enabled(channel, type)) {
+    return;
+  }
+  va_list args;
+  va_start(args, format);
+  vprint(type, func, format, args);
+  va_end(args);
+}
+
+/* what the macros call; they have checked the channel already. */
+void
+symb_log(struct symbsite* site, const struct symbdbgchannel* channel,
+         const char* format, ...)
 {
   va_list args;
   va_start(args, format);
-  if(dbgchannel_enabled(channel, type)) {
-    const char* fixit = type==SymbiontFixme ? "-FIXME" : "";
-    printf("%s[%ld](%s%s) ", color(type), pid, func, fixit);
-    (void) vprintf(format, args);
-    printf("%s\n", color_enabled ? C_NORM : "");
+  if(trace_on()) {
+    va_list rec;
+    va_copy(rec, args);
+    trace_put(site, channel->name, rec);
+    va_end(rec);
+    /* errors and warnings are still worth seeing right away. */
+    if(site->cls == SymbiontTrace || site->cls == SymbiontFixme) {
+      va_end(args);
+      return;
+    }
   }
+  vprint(site->cls, site->func, format, args);
   va_end(args);
 }
 
@@ -8,7 +8,18 @@
  * The user could enable / disable the above channel by setting the
  * LIBSITU_DEBUG environment variable:
  *
- *   export LIBSITU_DEBUG="stuff=+err,-warn,+trace" */
+ *   export LIBSITU_DEBUG="stuff=+err,-warn,+trace"
+ *
+ * A disabled message costs a load and a branch: its arguments are not even
+ * evaluated.  Classes below a floor can also be compiled out entirely, e.g.
+ * for production builds:
+ *
+ *   ./configure CPPFLAGS="-DSITU_MIN_LEVEL=warn"
+ *
+ * The levels, lowest first, are trace, fixme, warn and err.
+ *
+ * Messages can also be recorded in a binary form that is much cheaper than
+ * printing them; see trace.h. */
 #ifndef FP_SYMBIONT_DEBUG_H
 #define FP_SYMBIONT_DEBUG_H 1
 
@@ -31,6 +42,16 @@ struct symbdbgchannel {
   char name[32];
 };
 
+/* one TRACE/WARN/... in the source.  for internal use only. */
+struct symbsite {
+  enum SymbiontChanClass cls;
+  const char* func;
+  const char* fmt;
+  unsigned id; /* for binary traces; 0 until it's first used */
+  unsigned char nargs; /* how many of the arguments binary traces keep ... */
+  unsigned char kinds[6]; /* ... and what they are; see trace.h */
+};
+
 #define DEFAULT_CHFLAGS \
   (1U << SymbiontErr) | (1U << SymbiontWarn) | (1U << SymbiontFixme)
 /* creates a new debug channel.  debug channels are private to implementation,
@@ -43,19 +64,63 @@ struct symbdbgchannel {
     symb_parse_options(&symb_chn_##ch, dbg_); \
   }
 
-#define TRACE(ch, args...) \
-  symb_dbg(SymbiontTrace, &symb_chn_##ch, __FUNCTION__, args)
-#define ERR(ch, args...) \
-  symb_dbg(SymbiontErr, &symb_chn_##ch, __FUNCTION__, args)
-#define WARN(ch, args...) \
-  symb_dbg(SymbiontWarn, &symb_chn_##ch, __FUNCTION__, args)
-#define FIXME(ch, args...) \
-  symb_dbg(SymbiontFixme, &symb_chn_##ch, __FUNCTION__, args)
+#define SITU_LEVEL_trace 0
+#define SITU_LEVEL_fixme 1
+#define SITU_LEVEL_warn 2
+#define SITU_LEVEL_err 3
+#define SITU_LEVEL_(lvl) SITU_LEVEL__(lvl)
+#define SITU_LEVEL__(lvl) SITU_LEVEL_##lvl
+#ifndef SITU_MIN_LEVEL
+# define SITU_MIN_LEVEL trace
+#endif
+
+/* is the given class enabled on channel 'ch'? */
+#define DBG_ENABLED(cls, ch) \
+  __builtin_expect((symb_chn_##ch.flags & (1U << (cls))) != 0, 0)
+#define SYMB_DBG(cls, ch, fmt, args...) \
+  do { \
+    if(DBG_ENABLED(cls, ch)) { \
+      static struct symbsite symb_site_ = { cls, __FUNCTION__, fmt, 0, 0, \
+                                            {0,0,0,0,0,0} }; \
+      symb_log(&symb_site_, &symb_chn_##ch, fmt, ##args); \
+    } \
+  } while(0)
+/* compiled out, but still type-checked, and still 'uses' its arguments. */
+#define SYMB_NODBG(cls, ch, fmt, args...) \
+  do { \
+    if(0) { symb_dbg(cls, &symb_chn_##ch, __FUNCTION__, fmt, ##args); } \
+  } while(0)
+
+#if SITU_LEVEL_(SITU_MIN_LEVEL) <= SITU_LEVEL_trace
+# define TRACE(ch, fmt, args...) SYMB_DBG(SymbiontTrace, ch, fmt, ##args)
+# define TRACING(ch) DBG_ENABLED(SymbiontTrace, ch)
+#else
+# define TRACE(ch, fmt, args...) SYMB_NODBG(SymbiontTrace, ch, fmt, ##args)
+# define TRACING(ch) 0
+#endif
+#if SITU_LEVEL_(SITU_MIN_LEVEL) <= SITU_LEVEL_fixme
+# define FIXME(ch, fmt, args...) SYMB_DBG(SymbiontFixme, ch, fmt, ##args)
+#else
+# define FIXME(ch, fmt, args...) SYMB_NODBG(SymbiontFixme, ch, fmt, ##args)
+#endif
+#if SITU_LEVEL_(SITU_MIN_LEVEL) <= SITU_LEVEL_warn
+# define WARN(ch, fmt, args...) SYMB_DBG(SymbiontWarn, ch, fmt, ##args)
+#else
+# define WARN(ch, fmt, args...) SYMB_NODBG(SymbiontWarn, ch, fmt, ##args)
+#endif
+#if SITU_LEVEL_(SITU_MIN_LEVEL) <= SITU_LEVEL_err
+# define ERR(ch, fmt, args...) SYMB_DBG(SymbiontErr, ch, fmt, ##args)
+#else
+# define ERR(ch, fmt, args...) SYMB_NODBG(SymbiontErr, ch, fmt, ##args)
+#endif
 
 /* for internal use only. */
 extern void symb_dbg(enum SymbiontChanClass, const struct symbdbgchannel*,
                      const char* func, const char* format, ...)
                      __attribute__((format(printf, 4, 5)));
+extern void symb_log(struct symbsite*, const struct symbdbgchannel*,
+                     const char* format, ...)
+                     __attribute__((format(printf, 3, 4)));
 extern void symb_parse_options(struct symbdbgchannel*, const char* opt);
 
 #ifdef __cplusplus
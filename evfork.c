@@ -9,6 +9,7 @@
 #include <sys/wait.h>
 #include <unistd.h>
 #include "evfork.h"
+#include "spawner.h"
 
 static void
 ignore_children()
@@ -19,28 +20,6 @@ ignore_children()
   sigaction(SIGCLD, &nocld, NULL);
 }
 
-/* get rid of all the environment variables we don't *need* to run. */
-static void
-simplify_env()
-{
-  unsetenv("LD_PRELOAD");
-  const char* home = getenv("HOME");
-  const char* path = getenv("PATH");
-  const char* display = getenv("DISPLAY");
-  if(clearenv() != 0) {
-    fprintf(stderr, "Could not clear environment..");
-  }
-  if(setenv("PATH", path, 1) != 0) {
-    fprintf(stderr, "setenv PATH failed.\n");
-  }
-  if(setenv("HOME", home, 1) != 0) {
-    fprintf(stderr, "setenv HOME failed.\n");
-  }
-  if(display && setenv("DISPLAY", display, 1) != 0) {
-    fprintf(stderr, "setenv DISPLAY failed.\n");
-  }
-}
-
 static void reap();
 static void reap_sync(pid_t);
 typedef void (ryecatch)(pid_t);
@@ -116,16 +95,15 @@ launch(char* argv[])
   if(getenv("LIBSITU_SYNC") == NULL) {
     ignore_children(); /* prevent zombies. */
   }
-  pid_t pid = fork();
-  if(pid == -1) {
+  const char* preload[] = { "LD_PRELOAD=./libsitu.so", NULL };
+  char** env = minimal_env(preload);
+  if(env == NULL) {
     abort();
   }
-  if(pid == 0) {
-    simplify_env();
-    if(setenv("LD_PRELOAD", "./libsitu.so", 1) != 0) {
-      abort();
-    }
-    execvp(argv[0], argv);
+  const pid_t pid = spawn(argv, env, true);
+  free_env(env);
+  if(pid == -1) {
+    fprintf(stderr, "could not start %s: %d\n", argv[0], errno);
     abort();
   }
   rye(pid);
@@ -1,21 +1,73 @@
+#define _GNU_SOURCE 1
 #include <assert.h>
 #include <dlfcn.h>
 #include <errno.h>
 #include <fnmatch.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include "async.h"
+#include "buf.h"
 #include "compiler.h"
 #include "debug.h"
 #include "fproc.h"
+#include "stats.h"
 
 DECLARE_CHANNEL(freeproc);
 
-struct teelib transferlibs[MAX_FREEPROCS] = {{NULL,NULL,NULL,NULL,NULL,NULL}};
+struct teelib transferlibs[MAX_FREEPROCS] = {
+  {NULL,NULL,NULL,NULL,NULL,NULL,NULL,NULL,NULL, PTRN_EXACT,0,0}
+};
+
+void
+compile_pattern(struct teelib* tl)
+{
+  const char* p = tl->pattern;
+  const size_t len = strlen(p);
+  /* anything but '*' needs the real thing. */
+  if(strpbrk(p, "?[\\") != NULL) {
+    tl->kind = PTRN_GLOB;
+    return;
+  }
+  const char* star = strchr(p, '*');
+  if(star == NULL) {
+    tl->kind = PTRN_EXACT;
+    return;
+  }
+  const char* last = strrchr(p, '*');
+  if(star == last) {
+    tl->kind = PTRN_AFFIX;
+    tl->npre = (size_t)(star - p);
+    tl->nsuf = len - tl->npre - 1;
+    return;
+  }
+  if(star == p && last == p+len-1 && memchr(p+1, '*', len-2) == NULL) {
+    tl->kind = PTRN_CONTAINS;
+    tl->nsuf = len-2;
+    return;
+  }
+  tl->kind = PTRN_GLOB;
+}
 
 static bool
 patternmatch(const struct teelib* tl, const char* match)
 {
-  return fnmatch(tl->pattern, match, 0) == 0;
+  const char* p = tl->pattern;
+  switch(tl->kind) {
+    case PTRN_EXACT: return strcmp(p, match) == 0;
+    case PTRN_AFFIX: {
+      const size_t len = strlen(match);
+      const size_t plen = tl->npre + 1 + tl->nsuf;
+      return len >= tl->npre + tl->nsuf &&
+             memcmp(p, match, tl->npre) == 0 &&
+             memcmp(p+plen-tl->nsuf, match+len-tl->nsuf, tl->nsuf) == 0;
+    }
+    case PTRN_CONTAINS:
+      return memmem(match, strlen(match), p+1, tl->nsuf) != NULL;
+    case PTRN_GLOB: return fnmatch(p, match, 0) == 0;
+  }
+  assert(false);
+  return false;
 }
 
 struct teelib*
@@ -41,6 +93,7 @@ load_processor(FILE* from)
     return NULL;
   }
   TRACE(freeproc, "processor '%s' { %s }", lib->pattern, libname);
+  compile_pattern(lib);
   dlerror();
   /* This is a bit weird.  I'd like to add RTLD_DEEPBIND here, but it seems to
    * break some arbitrary cases, e.g. "bash /bin/ls".  For now, let's leave it
@@ -55,7 +108,10 @@ load_processor(FILE* from)
   }
   dlerror();
   lib->transfer = dlsym(lib->lib, "exec");
-  if(NULL == lib->transfer) {
+  lib->transfer_at = dlsym(lib->lib, "exec_at");
+  lib->transfer_iov = dlsym(lib->lib, "exec_iov");
+  if(NULL == lib->transfer && NULL == lib->transfer_at &&
+     NULL == lib->transfer_iov) {
     /* warn here: this is the main use of freeprocessing, so not having this
      * function is a bit weird.  but, still valid; maybe they only care about
      * metadata. */
@@ -79,6 +135,11 @@ load_processor(FILE* from)
   if(NULL == lib->finish) {
     TRACE(freeproc, "failed loading 'metadata' function: %s", dlerror());
   }
+  dlerror();
+  lib->region = dlsym(lib->lib, "region");
+  if(NULL == lib->region) {
+    TRACE(freeproc, "failed loading 'region' function: %s", dlerror());
+  }
   return lib;
 }
 
@@ -154,13 +215,44 @@ file(const struct teelib* tlibs, const char* ptrn)
   }
 }
 
+/* gives data to one processor, in whatever form it prefers.  Gather lists are
+ * never flattened: processors that take one buffer get one call per entry. */
+static void
+deliver(const struct teelib* tl, const char* fn, const struct iovec* iov,
+        int cnt, off_t off)
+{
+  const uint64_t t0 = stats_start();
+  if(tl->transfer_iov) {
+    tl->transfer_iov(fn, iov, cnt, off);
+  } else {
+    for(int i=0; i < cnt; ++i) {
+      if(tl->transfer_at) {
+        tl->transfer_at(fn, iov[i].iov_base, iov[i].iov_len, off);
+      } else {
+        tl->transfer(fn, iov[i].iov_base, iov[i].iov_len);
+      }
+      if(off != -1) {
+        off += (off_t)iov[i].iov_len;
+      }
+    }
+  }
+  if(t0 != 0) {
+    size_t n = 0;
+    for(int i=0; i < cnt; ++i) {
+      n += iov[i].iov_len;
+    }
+    stats_processor(tl, ST_EXEC, t0, n);
+  }
+}
+
 void
 stream(const struct teelib* tlibs, const char* ptrn, const void* buf,
        const size_t n)
 {
+  const struct iovec one = { (void*)buf, n };
   for(size_t i=0; i < MAX_FREEPROCS && tlibs[i].pattern; ++i) {
     if(patternmatch(&tlibs[i], ptrn)) {
-      tlibs[i].transfer(ptrn, buf, n);
+      deliver(&tlibs[i], ptrn, &one, 1, -1);
     }
   }
 }
@@ -172,7 +264,9 @@ metadata(const struct teelib* tlibs, const char* ptrn, const size_t dims[3],
   for(size_t i=0; i < MAX_FREEPROCS && tlibs[i].pattern; ++i) {
     if(patternmatch(&tlibs[i], ptrn)) {
       if(tlibs[i].metadata) {
+        const uint64_t t0 = stats_start();
         tlibs[i].metadata(ptrn, dims, type);
+        stats_processor(&tlibs[i], ST_METADATA, t0, 0);
       }
     }
   }
@@ -184,7 +278,200 @@ finish(const struct teelib* tlibs, const char* ptrn)
   for(size_t i=0; i < MAX_FREEPROCS && tlibs[i].pattern; ++i) {
     const struct teelib* tl = &tlibs[i];
     if(patternmatch(tl, ptrn) && tl->finish) {
+      const uint64_t t0 = stats_start();
       tl->finish(ptrn);
+      stats_processor(tl, ST_FINISH, t0, 0);
+    }
+  }
+}
+
+struct fpfile*
+fpfile_open(const struct teelib* tlibs, const char* fn)
+{
+  static unsigned nextworker = 0;
+  size_t n = 0;
+  for(size_t i=0; i < MAX_FREEPROCS && tlibs[i].pattern; ++i) {
+    if(patternmatch(&tlibs[i], fn)) { ++n; }
+  }
+  struct fpfile* f = malloc(sizeof(struct fpfile) +
+                            n*sizeof(const struct teelib*));
+  if(f == NULL) {
+    return NULL;
+  }
+  f->name = strdup(fn);
+  if(f->name == NULL) {
+    free(f);
+    return NULL;
+  }
+  f->worker = __atomic_fetch_add(&nextworker, 1, __ATOMIC_RELAXED);
+  f->n = 0;
+  f->offsets = false;
+  for(size_t i=0; i < MAX_FREEPROCS && tlibs[i].pattern; ++i) {
+    if(patternmatch(&tlibs[i], fn)) {
+      f->libs[f->n++] = &tlibs[i];
+      f->offsets |= tlibs[i].transfer_at || tlibs[i].transfer_iov;
+    }
+  }
+  assert(f->n == n);
+  TRACE(freeproc, "%zu processor(s) for %s", n, fn);
+  return f;
+}
+
+/* hands the operation to the asynchronous workers, if there are any, or
+ * otherwise just does it. */
+static void
+submit(const struct fpfile* f, const struct fpop* op)
+{
+  if(f->n == 0) { /* nobody would see it, so nothing was ever queued. */
+    if(op->kind == FPOP_CLOSE) {
+      fpfile_apply((struct fpfile*)f, op);
+    }
+    return;
+  }
+  if(async_enabled()) {
+    async_submit((struct fpfile*)f, op);
+  } else {
+    fpfile_apply((struct fpfile*)f, op);
+  }
+}
+
+void
+fpfile_close(struct fpfile* f)
+{
+  if(f) {
+    const struct fpop op = { .kind = FPOP_CLOSE };
+    submit(f, &op);
+  }
+}
+
+void
+fpfile_file(const struct fpfile* f)
+{
+  const struct fpop op = { .kind = FPOP_FILE };
+  submit(f, &op);
+}
+
+void
+fpfile_stream(const struct fpfile* f, const void* buf, const size_t n)
+{
+  fpfile_stream_at(f, buf, n, -1);
+}
+
+void
+fpfile_stream_at(const struct fpfile* f, const void* buf, const size_t n,
+                 off_t off)
+{
+  const struct fpop op = { .kind = FPOP_STREAM, .buf = buf, .n = n,
+                           .off = off };
+  submit(f, &op);
+}
+
+void
+fpfile_stream_iov(const struct fpfile* f, const struct iovec* iov, int cnt,
+                  off_t off)
+{
+  size_t n = 0;
+  for(int i=0; i < cnt; ++i) {
+    n += iov[i].iov_len;
+  }
+  const struct fpop op = { .kind = FPOP_STREAM, .n = n, .iov = iov,
+                           .iovcnt = cnt, .off = off };
+  submit(f, &op);
+}
+
+void
+fpfile_stream_buf(const struct fpfile* f, struct fpbuf* b, off_t off)
+{
+  const struct fpop op = {
+    .kind = FPOP_STREAM, .buf = b->data, .n = b->n, .ref = b, .off = off
+  };
+  submit(f, &op);
+}
+
+void
+fpfile_metadata(const struct fpfile* f, const size_t dims[3],
+                enum FPDataType type)
+{
+  const struct fpop op = {
+    .kind = FPOP_METADATA, .dims = { dims[0], dims[1], dims[2] }, .type = type
+  };
+  submit(f, &op);
+}
+
+void
+fpfile_region(const struct fpfile* f, const size_t offset[3],
+              const size_t extent[3])
+{
+  const struct fpop op = {
+    .kind = FPOP_REGION, .dims = { extent[0], extent[1], extent[2] },
+    .origin = { offset[0], offset[1], offset[2] }
+  };
+  submit(f, &op);
+}
+
+void
+fpfile_finish(const struct fpfile* f)
+{
+  const struct fpop op = { .kind = FPOP_FINISH };
+  submit(f, &op);
+}
+
+void
+fpfile_apply(struct fpfile* f, const struct fpop* op)
+{
+  switch(op->kind) {
+    case FPOP_FILE:
+      for(size_t i=0; i < f->n; ++i) {
+        if(f->libs[i]->file) {
+          f->libs[i]->file(f->name);
+        }
+      }
+      break;
+    case FPOP_STREAM: {
+      /* tell fpbuf_retain what processors might want to keep. */
+      const struct fpbuf borrowed = {
+        .data = op->buf, .n = op->n, .iov = op->iov, .iovcnt = op->iovcnt
+      };
+      const struct fpbuf* prev = fpbuf_current(op->ref ? op->ref : &borrowed);
+      const struct iovec one = { (void*)op->buf, op->n };
+      const struct iovec* iov = op->iov ? op->iov : &one;
+      const int cnt = op->iov ? op->iovcnt : 1;
+      for(size_t i=0; i < f->n; ++i) {
+        deliver(f->libs[i], f->name, iov, cnt, op->off);
+      }
+      fpbuf_current(prev);
+      break;
     }
+    case FPOP_METADATA:
+      for(size_t i=0; i < f->n; ++i) {
+        if(f->libs[i]->metadata) {
+          const uint64_t t0 = stats_start();
+          f->libs[i]->metadata(f->name, op->dims, op->type);
+          stats_processor(f->libs[i], ST_METADATA, t0, 0);
+        }
+      }
+      break;
+    case FPOP_REGION:
+      for(size_t i=0; i < f->n; ++i) {
+        if(f->libs[i]->region) {
+          const uint64_t t0 = stats_start();
+          f->libs[i]->region(f->name, op->origin, op->dims);
+          stats_processor(f->libs[i], ST_REGION, t0, 0);
+        }
+      }
+      break;
+    case FPOP_FINISH:
+      for(size_t i=0; i < f->n; ++i) {
+        if(f->libs[i]->finish) {
+          const uint64_t t0 = stats_start();
+          f->libs[i]->finish(f->name);
+          stats_processor(f->libs[i], ST_FINISH, t0, 0);
+        }
+      }
+      break;
+    case FPOP_CLOSE:
+      free(f->name);
+      free(f);
+      break;
   }
 }
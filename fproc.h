@@ -3,23 +3,53 @@
 
 #include <stdbool.h>
 #include <stdio.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 
+struct fpbuf;
 typedef void (ffqn)(const char* fn);
 typedef void (tfqn)(const char* fn, const void* buf, size_t n);
+/* 'off' is where the data goes in the file, or -1 if we don't know. */
+typedef void (atfqn)(const char* fn, const void* buf, size_t n, off_t off);
+typedef void (iovfqn)(const char* fn, const struct iovec* iov, int cnt,
+                      off_t off);
 typedef void (cfqn)(const char* fn);
 typedef void (mdfqn)(const char* fn, const size_t d[3], int);
+/* the part of the dataset the next data is for: 'extent' elements from
+ * 'offset', per dimension. */
+typedef void (rgfqn)(const char* fn, const size_t offset[3],
+                     const size_t extent[3]);
+/* how a pattern is matched.  most patterns in practice are a literal name or
+ * a literal with '*'s at one or both ends; those are matched directly, and
+ * only the rest go through fnmatch(3). */
+enum PatternKind {
+  PTRN_EXACT=0, /* "header.txt" */
+  PTRN_AFFIX, /* "pre*suf", where either part may be empty: "*.h5", "*" */
+  PTRN_CONTAINS, /* "*mid*" */
+  PTRN_GLOB, /* anything else: "?", "[...]", escapes, multiple '*'s */
+};
 /* a library to load and exec as we move data, tee-style. */
 struct teelib {
   char* pattern;
   void* lib;
   ffqn* file;
+  /* a processor exports at least one of these.  we use the first it has of
+   * 'transfer_iov', 'transfer_at', 'transfer'. */
   tfqn* transfer;
+  atfqn* transfer_at;
+  iovfqn* transfer_iov;
   cfqn* finish;
   mdfqn* metadata;
+  rgfqn* region;
+  enum PatternKind kind;
+  size_t npre; /* AFFIX: length of the literal prefix */
+  size_t nsuf; /* AFFIX: length of the literal suffix; CONTAINS: of 'mid' */
 };
 #define MAX_FREEPROCS 128U
 extern struct teelib transferlibs[MAX_FREEPROCS];
 
+/** works out how to match tl->pattern.  load_processor does this for you. */
+void compile_pattern(struct teelib* tl);
 /** @returns NULL when it failed to read a processor (e.g. on EOF, error) */
 struct teelib* load_processor(FILE* from);
 void load_processors(struct teelib* tlibs, FILE* from);
@@ -42,4 +72,57 @@ void metadata(const struct teelib* tlibs, const char* ptrn,
 /* call our 'finish' function on all libraries that match 'ptrn'. */
 void finish(const struct teelib* tlibs, const char* ptrn);
 
+/* The processors which apply to one particular file.  Matching a filename
+ * against every pattern is comparatively expensive, so interposers do it once,
+ * when the file is opened, and hold on to this for the file's lifetime.  The
+ * functions below are then equivalent to the ones above, but just walk the
+ * list of processors without any matching. */
+struct fpfile {
+  char* name;
+  unsigned worker; /* which asynchronous worker handles this file */
+  bool offsets; /* does any processor care where in the file data goes? */
+  size_t n; /* number of entries in 'libs' */
+  const struct teelib* libs[];
+};
+/** @returns NULL if we ran out of memory. */
+struct fpfile* fpfile_open(const struct teelib* tlibs, const char* fn);
+void fpfile_close(struct fpfile*);
+void fpfile_file(const struct fpfile*);
+void fpfile_stream(const struct fpfile*, const void* buf, const size_t n);
+/* like fpfile_stream, for data written at a known offset. */
+void fpfile_stream_at(const struct fpfile*, const void* buf, const size_t n,
+                      off_t off);
+/* like fpfile_stream_at, for a gather list.  'off' may be -1. */
+void fpfile_stream_iov(const struct fpfile*, const struct iovec* iov,
+                       int cnt, off_t off);
+/* like fpfile_stream, but the data is a snapshot we hold a reference to.
+ * nothing will be copied; the processors get the snapshot directly. */
+void fpfile_stream_buf(const struct fpfile*, struct fpbuf*, off_t off);
+void fpfile_metadata(const struct fpfile*, const size_t dims[3],
+                     enum FPDataType);
+void fpfile_region(const struct fpfile*, const size_t offset[3],
+                   const size_t extent[3]);
+void fpfile_finish(const struct fpfile*);
+
+/* One of the above calls, as data.  When processing is asynchronous (see
+ * async.h), the calls above queue one of these instead of running the
+ * processors; a worker thread then runs it with 'fpfile_apply'. */
+enum FPOpKind { FPOP_FILE=0, FPOP_STREAM, FPOP_METADATA, FPOP_REGION,
+                FPOP_FINISH, FPOP_CLOSE };
+struct fpop {
+  enum FPOpKind kind;
+  const void* buf; /* STREAM */
+  size_t n; /* STREAM */
+  struct fpbuf* ref; /* STREAM: if set, owns 'buf', which need not be copied */
+  const struct iovec* iov; /* STREAM: if set, the data, instead of 'buf' */
+  int iovcnt; /* STREAM: entries in 'iov' */
+  off_t off; /* STREAM: file offset of the data, or -1 */
+  size_t dims[3]; /* METADATA; REGION: the extent */
+  size_t origin[3]; /* REGION: the offset */
+  enum FPDataType type; /* METADATA */
+};
+/* runs the processors for the given operation, right now.  FPOP_CLOSE frees
+ * the file. */
+void fpfile_apply(struct fpfile*, const struct fpop*);
+
 #endif
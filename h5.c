@@ -2,16 +2,30 @@
 #define _GNU_SOURCE 1
 #include <assert.h>
 #include <dlfcn.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include "debug.h"
 #include "fproc.h"
+#include "idmap.h"
+#include "stats.h"
 
 DECLARE_CHANNEL(hdf5);
 
-/* types for HDF5 */
+/* types for HDF5.  These are HDF5 1.10's: hid_t is 64 bits since then. */
 typedef int herr_t;
-typedef int hid_t;
+typedef int64_t hid_t;
 typedef unsigned long long hsize_t;
+typedef long long hssize_t;
+/* the values of the HDF5 enums and constants we need. */
+enum { H5T_INTEGER=0, H5T_FLOAT=1 };
+enum { H5T_SGN_NONE=0 };
+enum { H5S_SEL_NONE=0, H5S_SEL_POINTS, H5S_SEL_HYPERSLABS, H5S_SEL_ALL };
+enum { H5D_CHUNKED=2 };
+#define H5S_ALL ((hid_t)0)
 
 typedef hid_t h5fcreatefqn(const char*, unsigned, hid_t, hid_t);
 typedef hid_t h5gcreate1fqn(hid_t, const char*, size_t);
@@ -21,8 +35,39 @@ typedef hid_t h5dopen1fqn(hid_t, const char*);
 typedef hid_t h5dopen2fqn(hid_t, const char*, hid_t);
 typedef herr_t h5dclosefqn(hid_t);
 typedef hid_t h5dcreate1fqn(hid_t, const char*, hid_t, hid_t, hid_t);
-typedef hid_t h5dcreate2fqn(hid_t, const char*, hid_t, hid_t, hid_t);
+typedef hid_t h5dcreate2fqn(hid_t, const char*, hid_t, hid_t, hid_t, hid_t,
+                            hid_t);
 typedef herr_t h5dwritefqn(hid_t, hid_t, hid_t, hid_t, hid_t, const void*);
+/* queries we make of HDF5 itself. */
+typedef int h5tget_classfqn(hid_t);
+typedef size_t h5tget_sizefqn(hid_t);
+typedef int h5tget_signfqn(hid_t);
+typedef int h5sget_simple_extent_dimsfqn(hid_t, hsize_t*, hsize_t*);
+typedef int h5sget_select_typefqn(hid_t);
+typedef hssize_t h5sget_select_hyper_nblocksfqn(hid_t);
+typedef herr_t h5sget_select_hyper_blocklistfqn(hid_t, hsize_t, hsize_t,
+                                                hsize_t*);
+typedef int h5sis_regular_hyperslabfqn(hid_t);
+typedef hid_t h5dget_spacefqn(hid_t);
+typedef int h5pget_layoutfqn(hid_t);
+typedef int h5pget_chunkfqn(hid_t, int, hsize_t*);
+typedef hid_t h5iget_file_idfqn(hid_t);
+typedef herr_t h5fget_intentfqn(hid_t, unsigned*);
+typedef herr_t h5fclosefqn(hid_t);
+typedef ssize_t h5iget_namefqn(hid_t, char*, size_t);
+/* things that change a dataspace's extent or selection. */
+typedef herr_t h5sselect_hyperslabfqn(hid_t, int, const hsize_t*,
+                                      const hsize_t*, const hsize_t*,
+                                      const hsize_t*);
+typedef herr_t h5sselect_elementsfqn(hid_t, int, size_t, const hsize_t*);
+typedef herr_t h5sselect_allfqn(hid_t);
+typedef herr_t h5sset_extent_simplefqn(hid_t, int, const hsize_t*,
+                                       const hsize_t*);
+typedef herr_t h5sextent_copyfqn(hid_t, hid_t);
+typedef herr_t h5soffset_simplefqn(hid_t, const hssize_t*);
+typedef herr_t h5smodify_selectfqn(hid_t, int, hid_t);
+typedef herr_t h5sget_regular_hyperslabfqn(hid_t, hsize_t*, hsize_t*, hsize_t*,
+                                           hsize_t*);
 
 static h5fcreatefqn* h5fcreatef = NULL;
 static h5gcreate1fqn* h5gcreate1f = NULL;
@@ -34,27 +79,74 @@ static h5dclosefqn* h5dclosef = NULL;
 static h5dcreate1fqn* h5dcreate1f = NULL;
 static h5dcreate2fqn* h5dcreate2f = NULL;
 static h5dwritefqn* h5dwritef = NULL;
+static h5tget_classfqn* h5tget_classf = NULL;
+static h5tget_sizefqn* h5tget_sizef = NULL;
+static h5tget_signfqn* h5tget_signf = NULL;
+static h5sget_simple_extent_dimsfqn* h5sget_dimsf = NULL;
+static h5sget_select_typefqn* h5sget_select_typef = NULL;
+static h5sget_select_hyper_nblocksfqn* h5sget_nblocksf = NULL;
+static h5sget_select_hyper_blocklistfqn* h5sget_blocklistf = NULL;
+static h5sis_regular_hyperslabfqn* h5sis_regularf = NULL;
+static h5sget_regular_hyperslabfqn* h5sget_regularf = NULL;
+static h5dget_spacefqn* h5dget_spacef = NULL;
+static h5dget_spacefqn* h5dget_create_plistf = NULL;
+static h5pget_layoutfqn* h5pget_layoutf = NULL;
+static h5pget_chunkfqn* h5pget_chunkf = NULL;
+static h5sclosefqn* h5pclosef = NULL;
+static h5iget_file_idfqn* h5iget_file_idf = NULL;
+static h5fget_intentfqn* h5fget_intentf = NULL;
+static h5fclosefqn* h5fclosef = NULL;
+static h5iget_namefqn* h5iget_namef = NULL;
+static h5iget_namefqn* h5fget_namef = NULL;
+static h5sselect_hyperslabfqn* h5sselect_hyperslabf = NULL;
+static h5sselect_elementsfqn* h5sselect_elementsf = NULL;
+static h5sselect_allfqn* h5sselect_allf = NULL;
+static h5sselect_allfqn* h5sselect_nonef = NULL;
+static h5sset_extent_simplefqn* h5sset_extent_simplef = NULL;
+static h5sselect_allfqn* h5sset_extent_nonef = NULL;
+static h5sextent_copyfqn* h5sextent_copyf = NULL;
+static h5soffset_simplefqn* h5soffset_simplef = NULL;
+static h5sextent_copyfqn* h5sselect_copyf = NULL;
+static h5smodify_selectfqn* h5smodify_selectf = NULL;
 
-struct openhdffile {
-  char* name;
-  size_t dims[3]; /* dims of the next impending write */
-  size_t sz; /* sizeof() the type being written */
+/* A dataset we're watching.  We keep the extent it was created with, for
+ * writes that select all of it.  A dataset may be open more than once, e.g.
+ * opened by two parts of the program; all of its ids share one of these, so
+ * processors see one 'file' and one 'finish' for it. */
+struct h5dset {
+  struct fpfile* file; /* the dataset's name and processors */
+  size_t dims[3]; /* padded with 1s for 1- and 2-D datasets */
+  size_t chunk[3]; /* chunk dims if the layout is chunked, else 0s */
+  char* key; /* which dataset this is: "file:/full/path" */
+  uintptr_t hash; /* of 'key' */
+  size_t refs; /* number of ids open on it */
+  struct h5dset* next; /* another dataset whose key has the same hash */
 };
-struct h5spaces {
-  hid_t id;
-  size_t dims[3];
-};
-struct h5meta {
-  hid_t dset;
-  hid_t space;
-  char* name;
-  enum FPDataType type;
+/* maps dataset ids to their h5dset.  Looked up on every H5Dwrite. */
+static struct idmap dsets = IDMAP_INITIALIZER;
+/* maps key hashes to the open datasets with that hash. */
+static struct idmap dnames = IDMAP_INITIALIZER;
+/* serializes changes to both of the above. */
+static pthread_mutex_t dsets_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* A box of elements within a dataspace of 3 or fewer dimensions: 'count'
+ * elements from 'start', in each dimension.  Dataspaces of lower rank are
+ * padded with trailing dimensions of size 1. */
+struct box {
+  size_t dims[3]; /* extent of the dataspace */
+  size_t start[3];
+  size_t count[3];
 };
 
-#define MAX_FILES 1024
-static const size_t N_SPACES = MAX_FILES;
-static struct h5spaces spaces[MAX_FILES] = {{0, {0,0,0}}};
-static struct h5meta metah5[MAX_FILES] = {{0, 0, NULL, FP_FLOAT32}};
+/* What we worked out about a dataspace used in a write, so the next write
+ * that uses it needn't ask HDF5 again.  Entries are dropped when the
+ * dataspace is closed or changed. */
+struct h5space {
+  struct box box;
+  bool ok; /* false if the selection is not one we can handle */
+};
+static struct idmap spaces = IDMAP_INITIALIZER;
+static pthread_mutex_t spaces_lock = PTHREAD_MUTEX_INITIALIZER;
 
 __attribute__((constructor(250))) static void
 fp_h5_init()
@@ -69,13 +161,364 @@ fp_h5_init()
   h5dcreate1f = dlsym(RTLD_NEXT, "H5Dcreate1");
   h5dcreate2f = dlsym(RTLD_NEXT, "H5Dcreate2");
   h5dwritef = dlsym(RTLD_NEXT, "H5Dwrite");
+  h5tget_classf = dlsym(RTLD_NEXT, "H5Tget_class");
+  h5tget_sizef = dlsym(RTLD_NEXT, "H5Tget_size");
+  h5tget_signf = dlsym(RTLD_NEXT, "H5Tget_sign");
+  h5sget_dimsf = dlsym(RTLD_NEXT, "H5Sget_simple_extent_dims");
+  h5sget_select_typef = dlsym(RTLD_NEXT, "H5Sget_select_type");
+  h5sget_nblocksf = dlsym(RTLD_NEXT, "H5Sget_select_hyper_nblocks");
+  h5sget_blocklistf = dlsym(RTLD_NEXT, "H5Sget_select_hyper_blocklist");
+  h5sis_regularf = dlsym(RTLD_NEXT, "H5Sis_regular_hyperslab");
+  h5sget_regularf = dlsym(RTLD_NEXT, "H5Sget_regular_hyperslab");
+  h5dget_spacef = dlsym(RTLD_NEXT, "H5Dget_space");
+  h5dget_create_plistf = dlsym(RTLD_NEXT, "H5Dget_create_plist");
+  h5pget_layoutf = dlsym(RTLD_NEXT, "H5Pget_layout");
+  h5pget_chunkf = dlsym(RTLD_NEXT, "H5Pget_chunk");
+  h5pclosef = dlsym(RTLD_NEXT, "H5Pclose");
+  h5iget_file_idf = dlsym(RTLD_NEXT, "H5Iget_file_id");
+  h5fget_intentf = dlsym(RTLD_NEXT, "H5Fget_intent");
+  h5fclosef = dlsym(RTLD_NEXT, "H5Fclose");
+  h5iget_namef = dlsym(RTLD_NEXT, "H5Iget_name");
+  h5fget_namef = dlsym(RTLD_NEXT, "H5Fget_name");
+  h5sselect_hyperslabf = dlsym(RTLD_NEXT, "H5Sselect_hyperslab");
+  h5sselect_elementsf = dlsym(RTLD_NEXT, "H5Sselect_elements");
+  h5sselect_allf = dlsym(RTLD_NEXT, "H5Sselect_all");
+  h5sselect_nonef = dlsym(RTLD_NEXT, "H5Sselect_none");
+  h5sset_extent_simplef = dlsym(RTLD_NEXT, "H5Sset_extent_simple");
+  h5sset_extent_nonef = dlsym(RTLD_NEXT, "H5Sset_extent_none");
+  h5sextent_copyf = dlsym(RTLD_NEXT, "H5Sextent_copy");
+  h5soffset_simplef = dlsym(RTLD_NEXT, "H5Soffset_simple");
+  h5sselect_copyf = dlsym(RTLD_NEXT, "H5Sselect_copy");
+  h5smodify_selectf = dlsym(RTLD_NEXT, "H5Smodify_select");
+}
+
+/* fills in the extent of 'space', selecting all of it.
+ * @returns false if it is not a simple dataspace of rank 3 or less. */
+static bool
+extent(hid_t space, struct box* b)
+{
+  hsize_t d[32];
+  const int rank = h5sget_dimsf(space, d, NULL);
+  if(rank < 0 || rank > 3) {
+    TRACE(hdf5, "dataspace %" PRId64 " has rank %d; ignoring it.", space,
+          rank);
+    return false;
+  }
+  for(int i=0; i < 3; ++i) {
+    b->dims[i] = b->count[i] = i < rank ? (size_t)d[i] : 1;
+    b->start[i] = 0;
+  }
+  return true;
+}
+
+/* narrows 'b' down to the selection in 'space'.
+ * @returns false if the selection is not a single box. */
+static bool
+selection(hid_t space, struct box* b)
+{
+  switch(h5sget_select_typef(space)) {
+    case H5S_SEL_ALL: return true;
+    case H5S_SEL_NONE:
+      b->count[0] = b->count[1] = b->count[2] = 0;
+      return true;
+    case H5S_SEL_HYPERSLABS: break;
+    default: return false;
+  }
+  hsize_t d[32];
+  const int rank = h5sget_dimsf(space, d, NULL);
+  /* the usual case: 'count' blocks per dimension, laid out regularly.  It is
+   * a single box when the blocks abut ('stride' == 'block'). */
+  if(h5sis_regularf != NULL && h5sis_regularf(space) > 0) {
+    hsize_t start[3], stride[3], count[3], block[3];
+    if(h5sget_regularf(space, start, stride, count, block) < 0) {
+      return false;
+    }
+    for(int i=0; i < rank; ++i) {
+      if(count[i] > 1 && stride[i] != block[i]) {
+        return false;
+      }
+      b->start[i] = (size_t)start[i];
+      b->count[i] = (size_t)(count[i] * block[i]);
+    }
+    return true;
+  }
+  /* otherwise, a union of blocks; we can do it if it is just one. */
+  const hssize_t nblocks = h5sget_nblocksf(space);
+  if(nblocks == 0) {
+    b->count[0] = b->count[1] = b->count[2] = 0;
+    return true;
+  }
+  hsize_t corners[6]; /* the block's start, then its last element. */
+  if(nblocks != 1 || h5sget_blocklistf(space, 0, 1, corners) < 0) {
+    return false;
+  }
+  for(int i=0; i < rank; ++i) {
+    b->start[i] = (size_t)corners[i];
+    b->count[i] = (size_t)(corners[rank+i] - corners[i] + 1);
+  }
+  return true;
+}
+
+/* fills in the box selected in 'space'.  'dflt' is used for H5S_ALL.
+ * @returns false if the selection is not a single box. */
+static bool
+decode(hid_t space, const struct box* dflt, struct box* b)
+{
+  if(space == H5S_ALL) {
+    *b = *dflt;
+    return true;
+  }
+  const struct h5space* sp = idmap_get(&spaces, (uintptr_t)space);
+  if(sp != NULL) {
+    *b = sp->box;
+    return sp->ok;
+  }
+  struct h5space* nsp = malloc(sizeof(struct h5space));
+  if(nsp == NULL) {
+    return extent(space, b) && selection(space, b);
+  }
+  nsp->ok = extent(space, &nsp->box) && selection(space, &nsp->box);
+  *b = nsp->box;
+  const bool ok = nsp->ok;
+  pthread_mutex_lock(&spaces_lock);
+  if(idmap_get(&spaces, (uintptr_t)space) != NULL ||
+     !idmap_put(&spaces, (uintptr_t)space, nsp)) {
+    free(nsp);
+  }
+  pthread_mutex_unlock(&spaces_lock);
+  return ok;
+}
+
+/* drops anything we know about 'space'. */
+static void
+forget(hid_t space)
+{
+  if(idmap_get(&spaces, (uintptr_t)space) == NULL) {
+    return;
+  }
+  pthread_mutex_lock(&spaces_lock);
+  free(idmap_del(&spaces, (uintptr_t)space));
+  pthread_mutex_unlock(&spaces_lock);
+}
+
+/* @returns the FPDataType for the HDF5 type, or -1 if there is none. */
+static int
+fptype(hid_t type, size_t* size)
+{
+  *size = h5tget_sizef(type);
+  const int cls = h5tget_classf(type);
+  if(cls == H5T_FLOAT) {
+    switch(*size) {
+      case 4: return FP_FLOAT32;
+      case 8: return FP_FLOAT64;
+    }
+  } else if(cls == H5T_INTEGER) {
+    const bool sgn = h5tget_signf(type) != H5T_SGN_NONE;
+    switch(*size) {
+      case 1: return sgn ? FP_INT8 : FP_UINT8;
+      case 2: return sgn ? FP_INT16 : FP_UINT16;
+      case 4: return sgn ? FP_INT32 : FP_UINT32;
+      case 8: return sgn ? FP_INT64 : FP_UINT64;
+    }
+  }
+  return -1;
+}
+
+/* @returns a string identifying the dataset, which is the same for all of
+ * its ids, or NULL if we ran out of memory. */
+static char*
+dataset_key(hid_t dset)
+{
+  const ssize_t flen = h5fget_namef(dset, NULL, 0);
+  const ssize_t plen = h5iget_namef(dset, NULL, 0);
+  if(flen < 0 || plen < 0) {
+    return NULL;
+  }
+  char* key = malloc((size_t)flen + (size_t)plen + 2);
+  if(key == NULL) {
+    return NULL;
+  }
+  h5fget_namef(dset, key, (size_t)flen+1);
+  key[flen] = ':';
+  h5iget_namef(dset, key+flen+1, (size_t)plen+1);
+  return key;
+}
+
+/* fills in the chunk dimensions of 'dset', or 0s if it isn't chunked. */
+static void
+chunking(hid_t dset, size_t chunk[3])
+{
+  chunk[0] = chunk[1] = chunk[2] = 0;
+  const hid_t dcpl = h5dget_create_plistf(dset);
+  if(dcpl < 0) {
+    return;
+  }
+  hsize_t d[3];
+  if(h5pget_layoutf(dcpl) == H5D_CHUNKED) {
+    const int rank = h5pget_chunkf(dcpl, 3, d);
+    for(int i=0; rank > 0 && i < 3; ++i) {
+      chunk[i] = i < rank ? (size_t)d[i] : 1;
+    }
+  }
+  h5pclosef(dcpl);
+}
+
+static uintptr_t
+hash(const char* s)
+{
+  uint64_t h = 14695981039346656037ULL; /* FNV-1a */
+  for(; *s; ++s) {
+    h = (h ^ (unsigned char)*s) * 1099511628211ULL;
+  }
+  /* 0 and UINTPTR_MAX are reserved by idmap. */
+  return (uintptr_t)h < 2 ? 2 : (uintptr_t)h == UINTPTR_MAX ? 3 : (uintptr_t)h;
+}
+
+/* @returns the open dataset 'key', or NULL.  needs dsets_lock. */
+static struct h5dset*
+find(const char* key, uintptr_t h)
+{
+  for(struct h5dset* d = idmap_get(&dnames, h); d != NULL; d = d->next) {
+    if(strcmp(d->key, key) == 0) {
+      return d;
+    }
+  }
+  return NULL;
+}
+
+/* starts watching the dataset 'dset', named 'name', whose extent is given by
+ * 'space'.  If it is already open under another id, the ids share it. */
+static void
+track(hid_t dset, const char* name, hid_t space)
+{
+  if(dset < 0 || !matches(transferlibs, name)) {
+    return;
+  }
+  struct box b;
+  if(!extent(space, &b)) {
+    WARN(hdf5, "'%s' is not a simple dataspace of rank <= 3; ignoring it.",
+         name);
+    return;
+  }
+  char* key = dataset_key(dset);
+  if(key == NULL) {
+    ERR(hdf5, "could not identify '%s'", name);
+    return;
+  }
+  const uintptr_t h = hash(key);
+  pthread_mutex_lock(&dsets_lock);
+  struct h5dset* ds = find(key, h);
+  const bool opened = ds == NULL;
+  if(opened) {
+    ds = malloc(sizeof(struct h5dset));
+    if(ds == NULL || (ds->file = fpfile_open(transferlibs, name)) == NULL) {
+      pthread_mutex_unlock(&dsets_lock);
+      ERR(hdf5, "out of memory tracking '%s'", name);
+      free(ds);
+      free(key);
+      return;
+    }
+    memcpy(ds->dims, b.dims, sizeof(ds->dims));
+    chunking(dset, ds->chunk);
+    ds->key = key;
+    ds->hash = h;
+    ds->refs = 0;
+    ds->next = NULL;
+  } else {
+    free(key);
+  }
+  bool ok = idmap_get(&dsets, (uintptr_t)dset) == NULL &&
+            idmap_put(&dsets, (uintptr_t)dset, ds);
+  if(ok && opened) {
+    struct h5dset* head = idmap_get(&dnames, h);
+    if(head != NULL) { /* a hash collision: chain it. */
+      ds->next = head->next;
+      head->next = ds;
+    } else if(!idmap_put(&dnames, h, ds)) {
+      idmap_del(&dsets, (uintptr_t)dset);
+      ok = false;
+    }
+  }
+  if(ok) {
+    ++ds->refs;
+  }
+  const bool unused = ds->refs == 0;
+  pthread_mutex_unlock(&dsets_lock);
+  if(!ok) {
+    WARN(hdf5, "could not track '%s' (%" PRId64 ")", name, dset);
+  }
+  TRACE(hdf5, "%s '%s' as %" PRId64, opened ? "tracking" : "sharing",
+        ds->key, dset);
+  if(unused) {
+    fpfile_close(ds->file);
+    free(ds->key);
+    free(ds);
+  } else if(opened) {
+    fpfile_file(ds->file);
+  }
+}
+
+/* the dataset id 'dset' is going away. */
+static void
+untrack(hid_t dset)
+{
+  pthread_mutex_lock(&dsets_lock);
+  struct h5dset* ds = idmap_del(&dsets, (uintptr_t)dset);
+  const bool last = ds != NULL && --ds->refs == 0;
+  if(last) {
+    struct h5dset* head = idmap_del(&dnames, ds->hash);
+    struct h5dset** p = &head;
+    while(*p != ds) {
+      p = &(*p)->next;
+    }
+    *p = ds->next;
+    if(head != NULL && !idmap_put(&dnames, ds->hash, head)) {
+      WARN(hdf5, "lost track of datasets sharing '%s''s hash", ds->key);
+    }
+  }
+  pthread_mutex_unlock(&dsets_lock);
+  if(last) {
+    TRACE(hdf5, "cleaning up dset %" PRId64 " (%s)", dset, ds->key);
+    fpfile_finish(ds->file);
+    fpfile_close(ds->file);
+    free(ds->key);
+    free(ds);
+  }
+}
+
+/* like 'track', for a dataset that already existed.  We only care about
+ * those in files opened for writing. */
+static void
+track_opened(hid_t dset, const char* name)
+{
+  if(dset < 0 || !matches(transferlibs, name)) {
+    return;
+  }
+  const hid_t fid = h5iget_file_idf(dset);
+  unsigned intent = 0;
+  const bool writable = fid >= 0 && h5fget_intentf(fid, &intent) >= 0 &&
+                        (intent & 0x0001u) != 0; /* H5F_ACC_RDWR */
+  if(fid >= 0) {
+    h5fclosef(fid);
+  }
+  if(!writable) {
+    TRACE(hdf5, "'%s' is read-only; ignoring it.", name);
+    return;
+  }
+  const hid_t space = h5dget_spacef(dset);
+  if(space < 0) {
+    return;
+  }
+  track(dset, name, space);
+  h5sclosef(space);
 }
 
 hid_t
 H5Fcreate(const char* name, unsigned flags, hid_t fcpl, hid_t fapl)
 {
   const hid_t rv = h5fcreatef(name, flags, fcpl, fapl);
-  TRACE(hdf5, "(%s, %u, %d, %d) = %d", name, flags, fcpl, fapl, rv);
+  TRACE(hdf5, "(%s, %u, %" PRId64 ", %" PRId64 ") = %" PRId64, name, flags,
+        fcpl, fapl, rv);
   return rv;
 }
 
@@ -83,7 +526,7 @@ hid_t
 H5Gcreate1(hid_t loc, const char* name, size_t hint)
 {
   const hid_t rv = h5gcreate1f(loc, name, hint);
-  TRACE(hdf5, "(%d, %s, %zu) = %d", loc, name, hint, rv);
+  TRACE(hdf5, "(%" PRId64 ", %s, %zu) = %" PRId64, loc, name, hint, rv);
   return rv;
 }
 
@@ -92,11 +535,14 @@ H5Screate_simple(int rank, const hsize_t* dims, const hsize_t* maxdims)
 {
   assert(h5screatesimplef);
   const hid_t rv = h5screatesimplef(rank, dims, maxdims);
+  if(!TRACING(hdf5)) {
+    return rv;
+  }
   char dstr[256];
   char mstr[256];
   strcpy(dstr, "[");
   strcpy(mstr, "[");
-  for(int i=0; i < rank; ++i) {
+  for(int i=0; i < rank && i < 6; ++i) {
     char s[32];
     snprintf(s, 32, "%llu ", dims[i]);
     strncat(dstr, s, 32);
@@ -107,147 +553,321 @@ H5Screate_simple(int rank, const hsize_t* dims, const hsize_t* maxdims)
   }
   strncat(dstr, "]", 2);
   strncat(mstr, "]", 2);
-  TRACE(hdf5, "(%d, %s, %s) = %d", rank, dstr, mstr, rv);
-  /* for now, we only care about 3D data; so skip if the rank is small. */
-  for(size_t i=0; rank >= 3 && i < N_SPACES; ++i) {
-    if(spaces[i].id == 0 || spaces[i].id == -1) {
-      spaces[i].id = rv;
-      assert(rank >= 3);
-      spaces[i].dims[0] = dims[0];
-      spaces[i].dims[1] = dims[1];
-      spaces[i].dims[2] = dims[2];
-    }
-  }
+  TRACE(hdf5, "(%d, %s, %s) = %" PRId64, rank, dstr, mstr, rv);
   return rv;
 }
 
 herr_t
 H5Sclose(hid_t id)
 {
-  const herr_t rv = h5sclosef(id);
-  assert(id > 0);
-  for(size_t i=0; i < N_SPACES; ++i) {
-    if(spaces[i].id == id) {
-      TRACE(hdf5, "closing data space %d", id);
-      spaces[i].id = -1;
-      spaces[i].dims[0] = spaces[i].dims[1] = spaces[i].dims[2] = 0;
-      break;
-    }
-  }
-  return rv;
+  TRACE(hdf5, "closing data space %" PRId64, id);
+  forget(id);
+  return h5sclosef(id);
+}
+
+/* these change a dataspace, so we forget what we knew about it. */
+herr_t
+H5Sselect_hyperslab(hid_t space, int op, const hsize_t* start,
+                    const hsize_t* stride, const hsize_t* count,
+                    const hsize_t* block)
+{
+  forget(space);
+  return h5sselect_hyperslabf(space, op, start, stride, count, block);
+}
+
+herr_t
+H5Sselect_elements(hid_t space, int op, size_t n, const hsize_t* coord)
+{
+  forget(space);
+  return h5sselect_elementsf(space, op, n, coord);
+}
+
+herr_t
+H5Sselect_all(hid_t space)
+{
+  forget(space);
+  return h5sselect_allf(space);
+}
+
+herr_t
+H5Sselect_none(hid_t space)
+{
+  forget(space);
+  return h5sselect_nonef(space);
+}
+
+herr_t
+H5Sset_extent_simple(hid_t space, int rank, const hsize_t* dims,
+                     const hsize_t* maxdims)
+{
+  forget(space);
+  return h5sset_extent_simplef(space, rank, dims, maxdims);
+}
+
+herr_t
+H5Sset_extent_none(hid_t space)
+{
+  forget(space);
+  return h5sset_extent_nonef(space);
+}
+
+herr_t
+H5Sextent_copy(hid_t dst, hid_t src)
+{
+  forget(dst);
+  return h5sextent_copyf(dst, src);
+}
+
+herr_t
+H5Soffset_simple(hid_t space, const hssize_t* offset)
+{
+  forget(space);
+  return h5soffset_simplef(space, offset);
+}
+
+herr_t
+H5Sselect_copy(hid_t dst, hid_t src)
+{
+  forget(dst);
+  return h5sselect_copyf(dst, src);
+}
+
+herr_t
+H5Smodify_select(hid_t space1, int op, hid_t space2)
+{
+  forget(space1);
+  return h5smodify_selectf(space1, op, space2);
 }
 
 hid_t
 H5Dopen1(hid_t loc, const char* name)
 {
-  TRACE(hdf5, "(%d, %s)", loc, name);
-  return h5dopen1f(loc, name);
+  const hid_t rv = h5dopen1f(loc, name);
+  TRACE(hdf5, "(%" PRId64 ", %s) = %" PRId64, loc, name, rv);
+  track_opened(rv, name);
+  return rv;
 }
 
 hid_t
 H5Dopen2(hid_t loc, const char* name, hid_t dapl)
 {
-  TRACE(hdf5, "(%d, %s, %d)", loc, name, dapl);
-  return h5dopen2f(loc, name, dapl);
+  const hid_t rv = h5dopen2f(loc, name, dapl);
+  TRACE(hdf5, "(%" PRId64 ", %s, %" PRId64 ") = %" PRId64, loc, name, dapl,
+        rv);
+  track_opened(rv, name);
+  return rv;
 }
 
-static size_t
-find_dataspace(hid_t id, const struct h5spaces* sp, size_t n)
+hid_t
+H5Dcreate1(hid_t loc, const char *name, hid_t type, hid_t space, hid_t dcpl)
 {
-  for(size_t i=0; i < n; ++i) {
-    if(sp[i].id == id) {
-      return i;
-    }
-  }
-  return n;
+  const hid_t rv = h5dcreate1f(loc, name, type, space, dcpl);
+  TRACE(hdf5, "(%" PRId64 ", %s, %" PRId64 ", %" PRId64 ", %" PRId64 ") = %"
+        PRId64, loc, name, type, space, dcpl, rv);
+  track(rv, name, space);
+  return rv;
 }
 
 hid_t
-H5Dcreate1(hid_t loc, const char *name, hid_t type, hid_t space, hid_t dcpl)
+H5Dcreate2(hid_t loc, const char* name, hid_t type, hid_t space, hid_t lcpl,
+           hid_t dcpl, hid_t dapl)
 {
-  hid_t rv = h5dcreate1f(loc, name, type, space, dcpl);
-  TRACE(hdf5, "(%d, %s, %d, %d, %d) = %d",loc, name, type, space, dcpl, rv);
-  const size_t sid = find_dataspace(space, spaces, N_SPACES);
-  if(sid == N_SPACES) { /* not found */
-    return rv;
+  const hid_t rv = h5dcreate2f(loc, name, type, space, lcpl, dcpl, dapl);
+  TRACE(hdf5, "(%" PRId64 ", %s, %" PRId64 ", %" PRId64 ", ...) = %" PRId64,
+        loc, name, type, space, rv);
+  track(rv, name, space);
+  return rv;
+}
+
+herr_t
+H5Dclose(hid_t id)
+{
+  if(idmap_get(&dsets, (uintptr_t)id) != NULL) {
+    untrack(id);
+  }
+  return h5dclosef(id);
+}
+
+/* @returns true if the elements of the box are one contiguous run. */
+static bool
+contiguous(const struct box* b)
+{
+  return (b->count[1] == b->dims[1] || b->count[0] == 1) &&
+         (b->count[2] == b->dims[2] || (b->count[0] == 1 && b->count[1] == 1));
+}
+
+/* hands the elements of 'buf' selected by 'mem' to the processors.  Each
+ * contiguous run of elements is one entry of a gather list. */
+static void
+stream_box(const struct fpfile* f, const char* buf, const struct box* mem,
+           size_t esize)
+{
+  /* innermost dimensions that are selected completely merge into one run. */
+  size_t run = mem->count[2];
+  unsigned outer = 2; /* dimensions [0,outer) need a loop */
+  if(mem->count[2] == mem->dims[2]) {
+    run *= mem->count[1];
+    outer = 1;
+    if(mem->count[1] == mem->dims[1]) {
+      run *= mem->count[0];
+      outer = 0;
+    }
   }
-  for(size_t i=0; i < MAX_FILES; ++i) {
-    if(metah5[i].dset <= 0 && metah5[i].space <= 0) {
-      assert(metah5[i].name == NULL);
-      metah5[i].dset = rv;
-      metah5[i].space = space;
-      metah5[i].name = strdup(name);
-      switch(type) {
-        case 50331691: metah5[i].type = FP_FLOAT64; break;
-        default:
-          ERR(hdf5, "unknown h5type: %d", type);
+  const size_t n0 = outer > 0 ? mem->count[0] : 1;
+  const size_t n1 = outer > 1 ? mem->count[1] : 1;
+  if(n0 * n1 == 1) {
+    const size_t elem = (mem->start[0]*mem->dims[1] + mem->start[1]) *
+                        mem->dims[2] + mem->start[2];
+    fpfile_stream(f, buf + elem*esize, run*esize);
+    return;
+  }
+  struct iovec iov[64];
+  int cnt = 0;
+  for(size_t i=0; i < n0; ++i) {
+    for(size_t j=0; j < n1; ++j) {
+      const size_t elem = ((mem->start[0]+i)*mem->dims[1] + mem->start[1]+j) *
+                          mem->dims[2] + mem->start[2];
+      iov[cnt].iov_base = (void*)(buf + elem*esize);
+      iov[cnt].iov_len = run*esize;
+      if(++cnt == 64) {
+        fpfile_stream_iov(f, iov, cnt, -1);
+        cnt = 0;
       }
-      break;
     }
   }
-  return rv;
+  if(cnt > 0) {
+    fpfile_stream_iov(f, iov, cnt, -1);
+  }
 }
 
-hid_t
-H5Dcreate2(hid_t loc, const char* name, hid_t type, hid_t space, hid_t dcpl)
+/* hands the write to the processors chunk by chunk: for each chunk the file
+ * box 'fb' touches, the part of the box in that chunk goes out as its own
+ * region, so processors can get going before the rest arrives.  'mb' is the
+ * memory box, which must be the same shape as 'fb'. */
+static void
+stream_chunks(const struct fpfile* f, const char* buf, const struct box* fb,
+              const struct box* mb, const size_t chunk[3], size_t esize)
 {
-  TRACE(hdf5, "(%d, %s, %d, %d, %d)",loc, name, type, space, dcpl);
-  return h5dcreate2f(loc, name, type, space, dcpl);
+  size_t first[3], last[3];
+  for(size_t d=0; d < 3; ++d) {
+    first[d] = fb->start[d] / chunk[d];
+    last[d] = (fb->start[d] + fb->count[d] - 1) / chunk[d];
+  }
+  size_t c[3];
+  for(c[0]=first[0]; c[0] <= last[0]; ++c[0]) {
+    for(c[1]=first[1]; c[1] <= last[1]; ++c[1]) {
+      for(c[2]=first[2]; c[2] <= last[2]; ++c[2]) {
+        size_t lo[3], n[3];
+        struct box sub = *mb;
+        for(size_t d=0; d < 3; ++d) {
+          const size_t clo = c[d]*chunk[d];
+          const size_t chi = clo + chunk[d];
+          const size_t end = fb->start[d] + fb->count[d];
+          lo[d] = fb->start[d] > clo ? fb->start[d] : clo;
+          n[d] = (end < chi ? end : chi) - lo[d];
+          sub.start[d] = mb->start[d] + (lo[d] - fb->start[d]);
+          sub.count[d] = n[d];
+        }
+        fpfile_region(f, lo, n);
+        stream_box(f, buf, &sub, esize);
+      }
+    }
+  }
 }
 
-herr_t
-H5Dclose(hid_t id)
+/* @returns true if the box 'fb' lies in more than one of the given chunks. */
+static bool
+spans_chunks(const struct box* fb, const size_t chunk[3])
 {
-  /* there's an issue here that if two data sets are open with different names,
-   * we close the first one that matches the ID, which might be the other
-   * dataset.
-   * this hasn't been an issue for the software we've instrumented so far... */
-  for(size_t i=0; i < MAX_FILES; ++i) {
-    if(metah5[i].dset == id) {
-      TRACE(hdf5, "cleaning up dset %d (%s)", id, metah5[i].name);
-      free(metah5[i].name);
-      metah5[i].name = NULL;
-      metah5[i].dset = -1;
-      metah5[i].space = -1;
-      break;
+  if(chunk[0] == 0) {
+    return false;
+  }
+  for(size_t d=0; d < 3; ++d) {
+    if(fb->start[d] / chunk[d] !=
+       (fb->start[d] + fb->count[d] - 1) / chunk[d]) {
+      return true;
     }
   }
-  return h5dclosef(id);
+  return false;
 }
 
-static size_t
-typewidth(enum FPDataType t)
+/* the real H5Dwrite, of 'bytes' of data, counted. */
+static herr_t
+counted_write(hid_t dset, hid_t memtype, hid_t memspace, hid_t filespace,
+              hid_t plist, const void* buf, size_t bytes)
 {
-  switch(t) {
-    case FP_INT8: case FP_UINT8: return 1;
-    case FP_INT16: case FP_UINT16: return 2;
-    case FP_INT32: case FP_UINT32: return 4;
-    case FP_INT64: case FP_UINT64: return 8;
-    case FP_FLOAT32: return 4;
-    case FP_FLOAT64: return 8;
-  }
-  assert(false);
+  const uint64_t t0 = stats_start();
+  const herr_t rv = h5dwritef(dset, memtype, memspace, filespace, plist, buf);
+  stats_io(IO_HDF5, t0, rv < 0 ? 0 : bytes);
+  return rv;
 }
 
 herr_t
 H5Dwrite(hid_t dset, hid_t memtype, hid_t memspace, hid_t filespace,
          hid_t plist, const void* buf)
 {
-  TRACE(hdf5, "(%d, %d, %d, %d, %d, %p)", dset, memtype, memspace,
-        filespace, plist, buf);
-  for(size_t i=0; i < MAX_FILES; ++i) {
-    if(metah5[i].dset == dset) {
-      const size_t sidx = find_dataspace(metah5[i].space, spaces, N_SPACES);
-      TRACE(hdf5, "h-write %s [%zu %zu %zu] %p", metah5[i].name,
-            spaces[sidx].dims[0], spaces[sidx].dims[1], spaces[sidx].dims[2],
-            buf);
-      metadata(transferlibs, metah5[i].name, spaces[sidx].dims,
-               metah5[i].type);
-      const size_t n = spaces[sidx].dims[0] * spaces[sidx].dims[1] *
-                       spaces[sidx].dims[2] * typewidth(metah5[i].type);
-      stream(transferlibs, metah5[i].name, buf, n);
-      break;
-    }
-  }
-  return h5dwritef(dset, memtype, memspace, filespace, plist, buf);
+  TRACE(hdf5, "(%" PRId64 ", %" PRId64 ", %" PRId64 ", %" PRId64 ", %" PRId64
+        ", %p)", dset, memtype, memspace, filespace, plist, buf);
+  const struct h5dset* ds = idmap_get(&dsets, (uintptr_t)dset);
+  if(ds == NULL) {
+    return h5dwritef(dset, memtype, memspace, filespace, plist, buf);
+  }
+  /* where the data goes in the dataset... */
+  struct box all, fbox;
+  memcpy(all.dims, ds->dims, sizeof(all.dims));
+  memcpy(all.count, ds->dims, sizeof(all.count));
+  all.start[0] = all.start[1] = all.start[2] = 0;
+  if(!decode(filespace, &all, &fbox)) {
+    WARN(hdf5, "%s: only single-block selections are supported; not "
+         "processing this write.", ds->file->name);
+    return h5dwritef(dset, memtype, memspace, filespace, plist, buf);
+  }
+  /* ... and where it comes from in memory.  H5S_ALL means memory is laid out
+   * like the file, with the same selection. */
+  struct box mbox;
+  if(!decode(memspace, &fbox, &mbox)) {
+    WARN(hdf5, "%s: only single-block memory selections are supported; not "
+         "processing this write.", ds->file->name);
+    return h5dwritef(dset, memtype, memspace, filespace, plist, buf);
+  }
+  const size_t npoints = fbox.count[0] * fbox.count[1] * fbox.count[2];
+  if(npoints == 0 ||
+     npoints != mbox.count[0] * mbox.count[1] * mbox.count[2]) {
+    return h5dwritef(dset, memtype, memspace, filespace, plist, buf);
+  }
+  size_t esize;
+  const int type = fptype(memtype, &esize);
+  TRACE(hdf5, "h-write %s [%zu %zu %zu] +[%zu %zu %zu] %p",
+        ds->file->name, fbox.start[0], fbox.start[1], fbox.start[2],
+        fbox.count[0], fbox.count[1], fbox.count[2], buf);
+  if(type >= 0) {
+    fpfile_metadata(ds->file, fbox.dims, (enum FPDataType)type);
+  } else {
+    TRACE(hdf5, "type %" PRId64 " has no FPDataType; no metadata.", memtype);
+  }
+  if(spans_chunks(&fbox, ds->chunk)) {
+    /* splitting into chunks needs the memory box to be the same shape as the
+     * file box.  When it is one contiguous run, it's as good as a dense box
+     * of that shape. */
+    struct box dense = { .start = {0,0,0} };
+    memcpy(dense.dims, fbox.count, sizeof(dense.dims));
+    memcpy(dense.count, fbox.count, sizeof(dense.count));
+    const char* base = buf;
+    bool same = memcmp(mbox.count, fbox.count, sizeof(mbox.count)) == 0;
+    if(!same && contiguous(&mbox)) {
+      base += ((mbox.start[0]*mbox.dims[1] + mbox.start[1]) * mbox.dims[2] +
+               mbox.start[2]) * esize;
+      mbox = dense;
+      same = true;
+    }
+    if(same) {
+      stream_chunks(ds->file, base, &fbox, &mbox, ds->chunk, esize);
+      return counted_write(dset, memtype, memspace, filespace, plist, buf,
+                           npoints*esize);
+    }
+  }
+  fpfile_region(ds->file, fbox.start, fbox.count);
+  stream_box(ds->file, buf, &mbox, esize);
+  return counted_write(dset, memtype, memspace, filespace, plist, buf,
+                       npoints*esize);
 }
@@ -0,0 +1,222 @@
+#define _POSIX_C_SOURCE 200112L
+#include <assert.h>
+#include <sched.h>
+#include <stdlib.h>
+#include "idmap.h"
+
+/* Concurrency works like this:
+ *   - readers load the current table pointer and probe it without locking.
+ *   - writers hold the table's lock.  They update a slot by storing its value
+ *     before its key, so a reader that sees the key also sees the value.
+ *   - when a writer needs to rebuild the table, it builds a new one off to
+ *     the side and publishes it with a single pointer store.  The old one can
+ *     only be freed once no reader is still probing it; see 'grace'. */
+
+struct idslot {
+  uintptr_t key;
+  void* value;
+};
+struct idtable {
+  size_t shift; /* 64 - log2(number of slots) */
+  struct idslot slots[];
+};
+
+/* an empty slot ends a probe sequence; a deleted one does not. */
+static const uintptr_t EMPTY = 0;
+static const uintptr_t DELETED = UINTPTR_MAX;
+static const size_t MIN_SLOTS = 16;
+
+/* Readers announce themselves in one of these counters while they are
+ * probing a table.  Threads are spread over the counters so that they do not
+ * fight over a cache line; a writer that retires a table waits until it has
+ * seen every counter at zero, at which point nobody can be using the old
+ * table.  Reader sections are a handful of loads, so the wait is short. */
+#define NREADERS 64U
+static struct {
+  unsigned long n;
+  char pad[64 - sizeof(unsigned long)];
+} readers[NREADERS] __attribute__((aligned(64)));
+static unsigned nextreader = 0;
+static __thread unsigned myreader = NREADERS;
+
+static unsigned long*
+reader_enter()
+{
+  if(myreader == NREADERS) {
+    myreader = __atomic_fetch_add(&nextreader, 1, __ATOMIC_RELAXED) % NREADERS;
+  }
+  unsigned long* n = &readers[myreader].n;
+  /* seq_cst: our announcement must be visible before we load the table
+   * pointer, pairing with the writer's store of the new one. */
+  __atomic_fetch_add(n, 1, __ATOMIC_SEQ_CST);
+  return n;
+}
+
+static void
+reader_exit(unsigned long* n)
+{
+  __atomic_fetch_sub(n, 1, __ATOMIC_RELEASE);
+}
+
+/* waits until no reader can still hold a table that was unpublished before
+ * this was called. */
+static void
+grace()
+{
+  for(size_t i=0; i < NREADERS; ++i) {
+    while(__atomic_load_n(&readers[i].n, __ATOMIC_SEQ_CST) != 0) {
+      sched_yield();
+    }
+  }
+}
+
+/* Fibonacci hashing: pointers and descriptors have lots of structure in their
+ * low bits (alignment, sequential allocation), multiplying by 2^64/phi spreads
+ * that into the high bits, which we then use as the index. */
+static size_t
+slot_of(const struct idtable* t, uintptr_t key)
+{
+  return (size_t)(((uint64_t)key * 0x9e3779b97f4a7c15ULL) >> t->shift);
+}
+
+static size_t
+nslots(const struct idtable* t)
+{
+  return t == NULL ? 0 : (size_t)1 << (64 - t->shift);
+}
+
+/* @returns the slot holding 'key' in 't', or NULL. */
+static struct idslot*
+find(struct idtable* t, uintptr_t key)
+{
+  const size_t mask = nslots(t) - 1;
+  for(size_t i=slot_of(t, key), n=0; n <= mask; i=(i+1) & mask, ++n) {
+    const uintptr_t k = __atomic_load_n(&t->slots[i].key, __ATOMIC_ACQUIRE);
+    if(k == key) {
+      return &t->slots[i];
+    }
+    if(k == EMPTY) {
+      return NULL;
+    }
+  }
+  return NULL;
+}
+
+void*
+idmap_get(const struct idmap* m, uintptr_t key)
+{
+  if(__atomic_load_n(&m->live, __ATOMIC_RELAXED) == 0) {
+    return NULL; /* the common case: we aren't tracking anything. */
+  }
+  unsigned long* rd = reader_enter();
+  struct idtable* t = __atomic_load_n(&m->tbl, __ATOMIC_ACQUIRE);
+  void* value = NULL;
+  if(t != NULL) {
+    const struct idslot* s = find(t, key);
+    if(s != NULL) {
+      value = __atomic_load_n(&s->value, __ATOMIC_ACQUIRE);
+    }
+  }
+  reader_exit(rd);
+  return value;
+}
+
+/* puts 'key' into the first free slot of its probe sequence.  assumes there is
+ * one.  @returns true if that slot had never been used. */
+static bool
+insert(struct idtable* t, uintptr_t key, void* value)
+{
+  const size_t mask = nslots(t) - 1;
+  size_t i = slot_of(t, key);
+  while(t->slots[i].key != EMPTY && t->slots[i].key != DELETED) {
+    i = (i+1) & mask;
+  }
+  const bool fresh = t->slots[i].key == EMPTY;
+  __atomic_store_n(&t->slots[i].value, value, __ATOMIC_RELEASE);
+  __atomic_store_n(&t->slots[i].key, key, __ATOMIC_RELEASE);
+  return fresh;
+}
+
+/* rebuilds the table with room for at least twice the live keys.  this also
+ * gets rid of any deleted slots.  caller holds the lock. */
+static bool
+rehash(struct idmap* m)
+{
+  size_t n = MIN_SLOTS;
+  size_t shift = 64 - 4;
+  while(n < (m->live+1) * 2) { n *= 2; --shift; }
+  struct idtable* t = calloc(1, sizeof(struct idtable) +
+                                n*sizeof(struct idslot));
+  if(t == NULL) {
+    return false;
+  }
+  t->shift = shift;
+  struct idtable* old = m->tbl;
+  size_t used = 0;
+  for(size_t i=0; i < nslots(old); ++i) {
+    if(old->slots[i].key != EMPTY && old->slots[i].key != DELETED) {
+      insert(t, old->slots[i].key, old->slots[i].value);
+      ++used;
+    }
+  }
+  m->used = used;
+  __atomic_store_n(&m->tbl, t, __ATOMIC_SEQ_CST);
+  if(old != NULL) {
+    grace();
+    free(old);
+  }
+  return true;
+}
+
+bool
+idmap_put(struct idmap* m, uintptr_t key, void* value)
+{
+  assert(key != EMPTY && key != DELETED);
+  pthread_mutex_lock(&m->lock);
+  assert(m->tbl == NULL || find(m->tbl, key) == NULL);
+  /* keep the load factor, deleted slots included, under 3/4: probe sequences
+   * stay short and negative lookups always find an empty slot. */
+  if((m->used+1)*4 > nslots(m->tbl)*3 && !rehash(m)) {
+    pthread_mutex_unlock(&m->lock);
+    return false;
+  }
+  if(insert(m->tbl, key, value)) {
+    ++m->used;
+  }
+  __atomic_add_fetch(&m->live, 1, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&m->lock);
+  return true;
+}
+
+void*
+idmap_del(struct idmap* m, uintptr_t key)
+{
+  if(__atomic_load_n(&m->live, __ATOMIC_RELAXED) == 0) {
+    return NULL;
+  }
+  pthread_mutex_lock(&m->lock);
+  void* value = NULL;
+  struct idslot* s = m->tbl == NULL ? NULL : find(m->tbl, key);
+  if(s != NULL) {
+    value = s->value;
+    __atomic_store_n(&s->key, DELETED, __ATOMIC_RELEASE);
+    __atomic_store_n(&s->value, NULL, __ATOMIC_RELEASE);
+    __atomic_sub_fetch(&m->live, 1, __ATOMIC_RELEASE);
+  }
+  pthread_mutex_unlock(&m->lock);
+  return value;
+}
+
+size_t
+idmap_size(const struct idmap* m)
+{
+  return __atomic_load_n(&m->live, __ATOMIC_RELAXED);
+}
+
+void
+idmap_free(struct idmap* m)
+{
+  free(m->tbl);
+  m->tbl = NULL;
+  m->live = m->used = 0;
+}
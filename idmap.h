@@ -0,0 +1,52 @@
+/* A small hash table mapping identifiers---pointers, descriptors, library
+ * handles---to data.  It is meant for the interposers' bookkeeping: the common
+ * operation is asking about an identifier we do not track, and that should be
+ * as cheap as possible.
+ *
+ * Tables need no constructor; a zero-initialized table is a valid, empty
+ * table, so it is safe to use them from within other constructors:
+ *
+ *   static struct idmap files = IDMAP_INITIALIZER;
+ *   idmap_put(&files, (uintptr_t)fp, of);
+ *   struct openfile* of = idmap_get(&files, (uintptr_t)fp);
+ *
+ * Tables are thread-safe.  Lookups never block: they do not take a lock, and
+ * never see a half-updated table.  'put' and 'del' are serialized per table;
+ * they are meant for open/close paths, not for every write.  The table does
+ * not manage the lifetime of values: if one thread removes a value while
+ * another looks it up, it is up to the caller not to free it from underneath
+ * the reader.
+ *
+ * The key values 0 and UINTPTR_MAX are reserved for internal use. */
+#ifndef FREEPROC_IDMAP_H
+#define FREEPROC_IDMAP_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct idtable;
+struct idmap {
+  struct idtable* tbl; /* NULL until the first 'put' */
+  size_t live; /* number of keys in the table */
+  size_t used; /* number of non-empty slots: live keys + deleted ones */
+  pthread_mutex_t lock; /* held by writers, never by readers */
+};
+#define IDMAP_INITIALIZER { NULL, 0, 0, PTHREAD_MUTEX_INITIALIZER }
+
+/** @returns the value associated with 'key', or NULL if there is none. */
+void* idmap_get(const struct idmap*, uintptr_t key);
+/** associates 'value' with 'key'.  'key' must not already be in the table.
+ * @returns false if the table could not be grown. */
+bool idmap_put(struct idmap*, uintptr_t key, void* value);
+/** removes 'key' from the table.
+ * @returns the value it was associated with, or NULL if it wasn't there. */
+void* idmap_del(struct idmap*, uintptr_t key);
+/** number of keys in the table. */
+size_t idmap_size(const struct idmap*);
+/** releases the table's memory.  does not touch the values.  there must not
+ * be concurrent users of the table. */
+void idmap_free(struct idmap*);
+
+#endif
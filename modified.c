@@ -1,36 +1,276 @@
-#define _POSIX_C_SOURCE 200112L
+#define _POSIX_C_SOURCE 200809L
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
 #include <sys/inotify.h>
-#include <sys/select.h>
 #include <unistd.h>
 #include "debug.h"
 #include "modified.h"
 
 DECLARE_CHANNEL(not);
-static int inotify = -1;
+
+/* what we know about one watch descriptor. */
+struct entry {
+  char* path; /* NULL if the descriptor isn't (or is no longer) ours */
+  /* one per watcher_add of the file that wasn't removed yet: adding a file
+   * twice gives the same descriptor. */
+  void** data;
+  size_t ndata;
+};
+struct watcher {
+  int inotify;
+  int epoll;
+  uint32_t mask;
+  struct entry* wd; /* indexed by watch descriptor */
+  size_t nwd;
+  /* paths of watches that went away; the caller still has them until the
+   * next call. */
+  char** dead;
+  size_t ndead;
+  /* events from the last read we haven't handed out yet.  'sub' is the next
+   * 'data' of the event at 'pos' to report it for. */
+  size_t pos, len, sub;
+  char buf[64*1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+};
+
+struct watcher*
+watcher_create(uint32_t mask)
+{
+  struct watcher* w = calloc(1, sizeof(struct watcher));
+  if(w == NULL) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  w->mask = mask ? mask : IN_CLOSE_WRITE;
+  w->inotify = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+  w->epoll = epoll_create1(EPOLL_CLOEXEC);
+  struct epoll_event ev = { .events = EPOLLIN, .data.fd = w->inotify };
+  if(w->inotify == -1 || w->epoll == -1 ||
+     epoll_ctl(w->epoll, EPOLL_CTL_ADD, w->inotify, &ev) != 0) {
+    const int saved_errno = errno;
+    ERR(not, "error initializing inotify: %d", errno);
+    if(w->inotify != -1) { close(w->inotify); }
+    if(w->epoll != -1) { close(w->epoll); }
+    free(w);
+    errno = saved_errno;
+    return NULL;
+  }
+  return w;
+}
+
+void
+watcher_destroy(struct watcher* w)
+{
+  if(w == NULL) {
+    return;
+  }
+  close(w->epoll);
+  close(w->inotify); /* takes all the watches with it. */
+  for(size_t i=0; i < w->nwd; ++i) {
+    free(w->wd[i].path);
+    free(w->wd[i].data);
+  }
+  for(size_t i=0; i < w->ndead; ++i) {
+    free(w->dead[i]);
+  }
+  free(w->dead);
+  free(w->wd);
+  free(w);
+}
+
+int
+watcher_add(struct watcher* w, const char* fn, void* data)
+{
+  assert(w);
+  const int wd = inotify_add_watch(w->inotify, fn, w->mask);
+  if(wd == -1) {
+    return -1;
+  }
+  if((size_t)wd >= w->nwd) {
+    const size_t n = (size_t)wd*2 + 8;
+    struct entry* e = realloc(w->wd, n*sizeof(struct entry));
+    if(e == NULL) {
+      inotify_rm_watch(w->inotify, wd);
+      errno = ENOMEM;
+      return -1;
+    }
+    memset(e + w->nwd, 0, (n - w->nwd)*sizeof(struct entry));
+    w->wd = e;
+    w->nwd = n;
+  }
+  struct entry* e = &w->wd[wd];
+  const bool fresh = e->path == NULL;
+  if(fresh) {
+    free(e->data); /* from a watch that went away on its own */
+    e->data = NULL;
+    e->ndata = 0;
+    e->path = strdup(fn);
+  }
+  void** d = e->path ? realloc(e->data, (e->ndata+1)*sizeof(void*)) : NULL;
+  if(d == NULL) {
+    if(fresh) {
+      inotify_rm_watch(w->inotify, wd);
+      free(e->path);
+      e->path = NULL;
+    }
+    errno = ENOMEM;
+    return -1;
+  }
+  e->data = d;
+  e->data[e->ndata++] = data;
+  TRACE(not, "now watching file %s with wd %d (%zu)", fn, wd, e->ndata);
+  return wd;
+}
+
+void
+watcher_remove(struct watcher* w, int wd, void* data)
+{
+  assert(w);
+  if(wd < 0 || (size_t)wd >= w->nwd || w->wd[wd].path == NULL) {
+    return;
+  }
+  struct entry* e = &w->wd[wd];
+  for(size_t i=0; i < e->ndata; ++i) {
+    if(e->data[i] == data) {
+      e->data[i] = e->data[--e->ndata];
+      break;
+    }
+  }
+  if(e->ndata > 0) { /* others still watch the file. */
+    return;
+  }
+  if(inotify_rm_watch(w->inotify, wd) != 0) {
+    WARN(not, "failed removing watch %d (%s): %d", wd, e->path, errno);
+  }
+  free(e->path);
+  e->path = NULL;
+  free(e->data);
+  e->data = NULL;
+}
+
+int
+watcher_fd(const struct watcher* w)
+{
+  return w->epoll;
+}
+
+ssize_t
+watcher_poll_all(struct watcher* w, struct watchevent* ev, size_t max)
+{
+  assert(w);
+  for(size_t i=0; i < w->ndead; ++i) {
+    free(w->dead[i]);
+  }
+  w->ndead = 0;
+  size_t n = 0;
+  while(n < max) {
+    if(w->pos >= w->len) {
+      if(n > 0) { /* one read per call. */
+        break;
+      }
+      const ssize_t b = read(w->inotify, w->buf, sizeof(w->buf));
+      if(b == -1 && (errno == EAGAIN || errno == EINTR)) {
+        break;
+      }
+      if(b <= 0) {
+        return -1;
+      }
+      w->pos = 0;
+      w->len = (size_t)b;
+    }
+    const struct inotify_event* ie =
+      (const struct inotify_event*)(w->buf + w->pos);
+    if(ie->mask & IN_Q_OVERFLOW) {
+      /* events were lost; the caller has to look at everything. */
+      WARN(not, "inotify queue overflowed; events were lost.");
+      ev[n++] = (struct watchevent){ -1, ie->mask, "", "", NULL };
+      w->pos += sizeof(struct inotify_event) + ie->len;
+      continue;
+    }
+    if(ie->wd < 0 || (size_t)ie->wd >= w->nwd || !w->wd[ie->wd].path ||
+       w->sub >= w->wd[ie->wd].ndata) {
+      w->pos += sizeof(struct inotify_event) + ie->len;
+      w->sub = 0;
+      continue; /* removed since */
+    }
+    /* the event goes out once for each add of the file. */
+    struct entry* e = &w->wd[ie->wd];
+    ev[n++] = (struct watchevent){
+      ie->wd, ie->mask, e->path, ie->len > 0 ? ie->name : "", e->data[w->sub]
+    };
+    if(++w->sub < e->ndata) {
+      continue;
+    }
+    w->pos += sizeof(struct inotify_event) + ie->len;
+    w->sub = 0;
+    if(ie->mask & IN_IGNORED) { /* the file went away, and the watch too. */
+      char** d = realloc(w->dead, (w->ndead+1) * sizeof(char*));
+      if(d == NULL) {
+        for(size_t i=n; i > 0 && ev[i-1].path == e->path; --i) {
+          ev[i-1].path = "";
+        }
+        free(e->path);
+      } else {
+        w->dead = d;
+        w->dead[w->ndead++] = e->path;
+      }
+      e->path = NULL;
+      free(e->data);
+      e->data = NULL;
+      e->ndata = 0;
+    }
+  }
+  TRACE(not, "%zu event(s)", n);
+  return (ssize_t)n;
+}
+
+ssize_t
+watcher_wait(struct watcher* w, struct watchevent* ev, size_t max,
+             int timeout)
+{
+  const ssize_t n = watcher_poll_all(w, ev, max);
+  if(n != 0) {
+    return n;
+  }
+  struct epoll_event e;
+  int rv;
+  while((rv = epoll_wait(w->epoll, &e, 1, timeout)) == -1 && errno == EINTR) {
+    ;
+  }
+  if(rv <= 0) {
+    return rv;
+  }
+  return watcher_poll_all(w, ev, max);
+}
+
+/* the original interface, on top of one shared watcher. */
+static struct watcher* shared = NULL;
 
 struct watch_t {
   int des;
+  bool modified; /* seen an event we haven't reported yet */
+  struct watch_t* prev;
+  struct watch_t* next;
 };
+/* every watch that hasn't been Unwatch'd, for when we lose track of which
+ * changed. */
+static struct watch_t* live = NULL;
 
 __attribute__((constructor(1000))) static void
 setup_inotify()
 {
   TRACE(not, "initializing inotify");
-  if((inotify = inotify_init1(IN_CLOEXEC)) == -1) {
-    ERR(not, "error initializing inotify!\n");
-    return;
-  }
+  shared = watcher_create(IN_CLOSE_WRITE);
 }
 
 __attribute__((destructor(1000))) static void
 cleanup_inotify()
 {
-  if(inotify != -1) {
-    close(inotify);
-    inotify = -1;
-  }
+  watcher_destroy(shared);
+  shared = NULL;
 }
 
 watch*
@@ -38,15 +278,19 @@ Watch(const char* fn)
 {
   struct watch_t* wt = malloc(sizeof(struct watch_t));
   if(NULL == wt) { errno = ENOMEM; return NULL; }
+  if(shared == NULL) { errno = ENOSYS; free(wt); return NULL; }
 
-  const uint32_t wflags = IN_CLOSE_WRITE;
-  if((wt->des = inotify_add_watch(inotify, fn, wflags)) == -1) {
+  wt->modified = false;
+  if((wt->des = watcher_add(shared, fn, wt)) == -1) {
     const int saved_errno = errno;
     free(wt);
     errno = saved_errno;
     return NULL;
   }
-  TRACE(not, "now watching file %s with fdes %d", fn, wt->des);
+  wt->prev = NULL;
+  wt->next = live;
+  if(live) { live->prev = wt; }
+  live = wt;
   return wt;
 }
 
@@ -54,46 +298,38 @@ bool
 Modified(const watch* w)
 {
   assert(w);
-  const struct watch_t* wt = (const struct watch_t*)w;
-
-  fd_set rfds;
-  FD_ZERO(&rfds);
-  FD_SET(wt->des, &rfds);
-  FD_SET(inotify, &rfds);
-
-  struct timeval tv;
-  tv.tv_sec = tv.tv_usec = 0;
-  tv.tv_usec = 1;
-
-  const int rv = select(inotify+1, &rfds, NULL, NULL, &tv);
-  TRACE(not, "seeing if fdes %d changed... (%d)", wt->des, rv);
-  if(rv == -1) {
-    WARN(not, "error in select: %d\n", errno);
-    return false;
-  }
-  if(FD_ISSET(inotify, &rfds)) {
-    /* read the event to clear the queue.. but we don't care about the data,
-     * since we know what had to happen. */
-    struct inotify_event ev;
-    const ssize_t b = read(inotify, &ev, sizeof(struct inotify_event));
-    if(b == -1) {
-      ERR(not, "err clearing event queue: %d", errno);
-      return true;
-    }
-    if(b < (ssize_t)sizeof(struct inotify_event)) {
-      WARN(not, "could not read full inotify struct.. can this happen?");
-      return true;
+  struct watch_t* wt = (struct watch_t*)w;
+  /* whatever happened to any of the watches, note it in that watch. */
+  struct watchevent ev[64];
+  ssize_t n;
+  while((n = watcher_poll_all(shared, ev, 64)) > 0) {
+    for(ssize_t i=0; i < n; ++i) {
+      if(ev[i].wd == -1 && (ev[i].mask & IN_Q_OVERFLOW)) {
+        /* events were lost: any of them might have changed. */
+        for(struct watch_t* l=live; l; l=l->next) {
+          l->modified = true;
+        }
+      } else if(ev[i].data != NULL) {
+        ((struct watch_t*)ev[i].data)->modified = true;
+      }
     }
   }
-  return FD_ISSET(inotify, &rfds);
+  if(n == -1) {
+    WARN(not, "error reading events: %d", errno);
+  }
+  TRACE(not, "seeing if wd %d changed... (%d)", wt->des, wt->modified);
+  const bool rv = wt->modified;
+  wt->modified = false;
+  return rv;
 }
 
 void
 Unwatch(watch* w)
 {
   assert(w);
-  const struct watch_t* wt = (const struct watch_t*)w;
-  if(close(wt->des) != 0) {
-    WARN(not, "failed closing watchfd %d: %d\n", wt->des, errno);
-  }
+  struct watch_t* wt = (struct watch_t*)w;
+  watcher_remove(shared, wt->des, wt);
+  if(wt->prev) { wt->prev->next = wt->next; } else { live = wt->next; }
+  if(wt->next) { wt->next->prev = wt->prev; }
+  free(wt);
 }
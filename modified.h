@@ -2,14 +2,65 @@
 #define SYMBIOTE_MODIFIED_H
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/* Watches any number of files for changes.  Events are read in batches, as
+ * many as the kernel has queued, with one read.  The watcher's descriptor is
+ * an epoll instance that becomes readable when events are waiting, so it can
+ * go into the caller's own poll/epoll loop:
+ *
+ *   struct watcher* w = watcher_create(IN_CLOSE_WRITE);
+ *   watcher_add(w, "restart.h5", NULL);
+ *   ... epoll_ctl(myloop, EPOLL_CTL_ADD, watcher_fd(w), &ev) ...
+ *   struct watchevent ev[16];
+ *   const ssize_t n = watcher_poll_all(w, ev, 16);
+ *
+ * watcher_poll_all never blocks; when nothing happened it costs one system
+ * call. */
+struct watcher;
+struct watchevent {
+  int wd; /* which watch fired; from watcher_add */
+  uint32_t mask; /* IN_* bits, see inotify(7) */
+  const char* path; /* the watched file or directory */
+  const char* name; /* for a directory, the entry in it; else "" */
+  void* data; /* given to watcher_add */
+};
+
+/** 'mask' is the inotify events to watch for; 0 means IN_CLOSE_WRITE.
+ * @returns NULL on error, with errno set. */
+struct watcher* watcher_create(uint32_t mask);
+void watcher_destroy(struct watcher*);
+/** starts watching 'fn'.  'data' comes back with its events.  Adding a file
+ * that is already watched gives the same descriptor, and its events then come
+ * once for each 'data'.
+ * @returns the watch descriptor, or -1 and sets errno. */
+int watcher_add(struct watcher*, const char* fn, void* data);
+/** undoes the watcher_add of 'data'; the watch stops when nothing is left
+ * that added it.  events already queued for 'data' are dropped. */
+void watcher_remove(struct watcher*, int wd, void* data);
+/** an epoll descriptor that is readable whenever events are waiting. */
+int watcher_fd(const struct watcher*);
+/** fills in up to 'max' events that have happened, without waiting.  Strings
+ * in them are valid until the next call.  @returns how many, or -1 on error
+ * (with errno set). */
+ssize_t watcher_poll_all(struct watcher*, struct watchevent* ev, size_t max);
+/** like watcher_poll_all, but waits up to 'timeout' ms (-1: forever) for the
+ * first event. */
+ssize_t watcher_wait(struct watcher*, struct watchevent* ev, size_t max,
+                     int timeout);
+
+/* The original, one-file-at-a-time interface.  All such watches share one
+ * watcher. */
 typedef void watch;
 
 watch* Watch(const char* fn);
+/* has the file been written (and closed) since we last asked? */
 bool Modified(const watch*);
 void Unwatch(watch*);
 
@@ -1,56 +1,235 @@
 #define _GNU_SOURCE 1
+#include <aio.h>
 #include <assert.h>
 #include <dlfcn.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <pthread.h>
 #include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
+#include "async.h"
+#include "buf.h"
 #include "debug.h"
 #include "fproc.h"
+#include "posix.h"
+#include "stats.h"
 
 DECLARE_CHANNEL(posix);
 
 typedef int (openfqn)(const char*, int, ...);
 typedef ssize_t (writefqn)(int, const void*, size_t);
 typedef int (closefqn)(int);
+typedef off_t (lseekfqn)(int, off_t, int);
+typedef off64_t (lseek64fqn)(int, off64_t, int);
+typedef ssize_t (pwritefqn)(int, const void*, size_t, off_t);
+typedef ssize_t (pwrite64fqn)(int, const void*, size_t, off64_t);
+typedef ssize_t (writevfqn)(int, const struct iovec*, int);
+typedef ssize_t (pwritevfqn)(int, const struct iovec*, int, off_t);
+typedef ssize_t (pwritev64fqn)(int, const struct iovec*, int, off64_t);
+typedef int (aiowritefqn)(struct aiocb*);
+typedef int (aiowrite64fqn)(struct aiocb64*);
 
 static openfqn* openf = NULL;
+static openfqn* open64f = NULL;
 static writefqn* writef = NULL;
 static closefqn* closef = NULL;
+static lseekfqn* lseekf = NULL;
+static lseek64fqn* lseek64f = NULL;
+static pwritefqn* pwritef = NULL;
+static pwrite64fqn* pwrite64f = NULL;
+static writevfqn* writevf = NULL;
+static pwritevfqn* pwritevf = NULL;
+static pwritev64fqn* pwritev64f = NULL;
+static aiowritefqn* aiowritef = NULL;
+static aiowrite64fqn* aiowrite64f = NULL;
 
 /* When the file is closed, we need the filename so we can pass it to the vis
  * code.  But we're only given the filename on open, not close.  This table
- * maps FILE*s to filenames, which we populate on open.
- * \note This is *not* currently thread-safe. */
+ * maps descriptors to filenames, which we populate on open.
+ * The table is indexed directly by descriptor.  Most writes go to descriptors
+ * we do not track (stdout, sockets, files no processor cares about), so the
+ * important case is answering "is this one ours?" quickly: that's a bounds
+ * check and a load.
+ *
+ * The table is safe to use from multiple threads without locks.  Descriptors
+ * are unique, so opens and closes claim and release their slot with a single
+ * compare-and-swap.  Growing is the tricky part: the grower copies every slot
+ * into a new table, marking each old slot as 'moved' as it goes.  Anybody who
+ * finds a moved slot knows to wait for, and use, the new table.  Old tables are
+ * kept around rather than freed, since a reader might still be looking at
+ * one; there are only ever log(n) of them. */
 struct openposixfile {
-  char* name;
+  struct fpfile* file; /* the file's name and processors */
   int fd;
+  int rfd; /* read-only descriptor for zero-copy snapshots, or -1 */
+  off_t pos; /* the file position, or -1 if we don't know it (O_APPEND) */
+  bool append; /* opened O_APPEND: every write goes to the end, wherever
+                * we seek or pwrite to */
 };
-#define MAX_FILES 1024
-static struct openposixfile posix_files[MAX_FILES] = {{NULL, 0}};
-/* predicate for finding a posix_file.  2nd argument should be a pointer to the
- * file descriptor.*/
-typedef int (ofposixp)(const struct openposixfile*, const void*);
+struct fdtable {
+  size_t n; /* number of entries in 'files' */
+  struct fdtable* prev; /* the table this one replaced */
+  struct openposixfile* files[];
+};
+static struct fdtable nofiles = { 0, NULL };
+static struct fdtable* posix_files = &nofiles;
+static pthread_mutex_t grow_lock = PTHREAD_MUTEX_INITIALIZER;
+/* we start with a table as large as the descriptor limit, but some systems set
+ * that limit absurdly high.  Cap the initial allocation; 'ofposix_reserve'
+ * will grow the table if we ever see a descriptor beyond it. */
+static const size_t MAX_INITIAL_FILES = 65536;
+
+/* In asynchronous mode (see async.h) every write is normally copied into a
+ * queue.  For big writes to regular files we can do better: once the write
+ * has happened, the data is in the file's pages, and a read-only mapping of
+ * those pages is a snapshot we can hand to the processors without any copy.
+ * LIBSITU_ZEROCOPY sets how big a write must be for that; unset, or 0,
+ * disables it.  The mapping reflects the file, so if the simulation rewrites
+ * or truncates that region before the processors get to it, they see (or
+ * fault on) the change; checkpoint dumps, which are written once, are the
+ * intended use. */
+static size_t zerocopy_min = 0;
+
+/* see posix.h. */
+static __thread bool suppressed = false;
+
+void
+posix_suppress(bool s)
+{
+  suppressed = s;
+}
+
+/* the low bit of a slot is set once the slot was copied to a newer table. */
+#define MOVED(of) ((struct openposixfile*)((uintptr_t)(of) | 1U))
+#define WAS_MOVED(of) (((uintptr_t)(of) & 1U) != 0)
+
+static struct fdtable*
+current_table()
+{
+  return __atomic_load_n(&posix_files, __ATOMIC_ACQUIRE);
+}
 
 static struct openposixfile*
-ofposix_find(struct openposixfile* arr, ofposixp* p, const void* userdata)
+ofposix_find(int fd)
 {
-  for(size_t i=0; i < MAX_FILES; ++i) {
-    if(p(&arr[i], userdata)) {
-      return &arr[i];
+  for(;;) {
+    const struct fdtable* t = current_table();
+    if((size_t)fd >= t->n) { /* negative fds wrap, too. */
+      return NULL;
+    }
+    struct openposixfile* of = __atomic_load_n(&t->files[fd],
+                                               __ATOMIC_ACQUIRE);
+    if(!WAS_MOVED(of)) {
+      return of;
     }
+    /* the table is growing; the new one is about to be published. */
   }
-  return NULL;
 }
-static int
-fd_of(const struct openposixfile* f, const void* fdvoid)
+
+/* grows the table so that 'fd' is a valid index.
+ * @returns false if we could not allocate the memory. */
+static bool
+ofposix_reserve(int fd)
 {
-  const int* fd = (const int*)fdvoid;
-  return f->fd == (*fd);
+  assert(fd >= 0);
+  if((size_t)fd < current_table()->n) {
+    return true;
+  }
+  pthread_mutex_lock(&grow_lock);
+  struct fdtable* old = current_table();
+  if((size_t)fd < old->n) { /* somebody else grew it while we waited. */
+    pthread_mutex_unlock(&grow_lock);
+    return true;
+  }
+  size_t n = old->n == 0 ? 1 : old->n;
+  while(n <= (size_t)fd) { n *= 2; }
+  struct fdtable* t = calloc(1, sizeof(struct fdtable) +
+                                sizeof(struct openposixfile*) * n);
+  if(t == NULL) {
+    pthread_mutex_unlock(&grow_lock);
+    return false;
+  }
+  t->n = n;
+  t->prev = old;
+  for(size_t i=0; i < old->n; ++i) {
+    struct openposixfile* of = __atomic_load_n(&old->files[i],
+                                               __ATOMIC_ACQUIRE);
+    while(!__atomic_compare_exchange_n(&old->files[i], &of, MOVED(of), false,
+                                       __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      ; /* 'of' was reloaded; an open or close beat us to it.  again. */
+    }
+    t->files[i] = of;
+  }
+  __atomic_store_n(&posix_files, t, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&grow_lock);
+  return true;
+}
+
+/* puts 'of' in the (empty) slot for 'fd'. */
+static bool
+ofposix_claim(int fd, struct openposixfile* of)
+{
+  for(;;) {
+    if(!ofposix_reserve(fd)) {
+      return false;
+    }
+    struct fdtable* t = current_table();
+    struct openposixfile* cur = NULL;
+    if(__atomic_compare_exchange_n(&t->files[fd], &cur, of, false,
+                                   __ATOMIC_RELEASE, __ATOMIC_ACQUIRE)) {
+      return true;
+    }
+    if(!WAS_MOVED(cur)) {
+      /* the kernel gave us a descriptor we think is still open.  we must have
+       * missed its close (e.g. it was closed via a path we don't wrap). */
+      WARN(posix, "FD %d already in use by '%s'?", fd, cur->file->name);
+      return false;
+    }
+  }
+}
+
+/* empties the slot for 'fd'.  @returns what used to be there. */
+static struct openposixfile*
+ofposix_release(int fd)
+{
+  for(;;) {
+    struct fdtable* t = current_table();
+    if((size_t)fd >= t->n) {
+      return NULL;
+    }
+    struct openposixfile* of = __atomic_load_n(&t->files[fd],
+                                               __ATOMIC_ACQUIRE);
+    if(of == NULL) {
+      return NULL;
+    }
+    if(!WAS_MOVED(of) &&
+       __atomic_compare_exchange_n(&t->files[fd], &of, NULL, false,
+                                   __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      return of;
+    }
+  }
+}
+
+static void
+ofposix_init_table()
+{
+  struct rlimit lim;
+  size_t n = 1024;
+  if(getrlimit(RLIMIT_NOFILE, &lim) == 0 && lim.rlim_cur != RLIM_INFINITY) {
+    n = (size_t)lim.rlim_cur;
+  }
+  if(n > MAX_INITIAL_FILES) { n = MAX_INITIAL_FILES; }
+  if(!ofposix_reserve((int)n-1)) {
+    WARN(posix, "could not allocate %zu-entry descriptor table", n);
+  }
 }
 
 __attribute__((constructor(201))) static void
@@ -58,31 +237,45 @@ fp_posix_init()
 {
   TRACE(posix, "[%ld] loading function pointers.", (long)getpid());
   openf = dlsym(RTLD_NEXT, "open");
+  open64f = dlsym(RTLD_NEXT, "open64");
   writef = dlsym(RTLD_NEXT, "write");
   closef = dlsym(RTLD_NEXT, "close");
+  lseekf = dlsym(RTLD_NEXT, "lseek");
+  lseek64f = dlsym(RTLD_NEXT, "lseek64");
+  pwritef = dlsym(RTLD_NEXT, "pwrite");
+  pwrite64f = dlsym(RTLD_NEXT, "pwrite64");
+  writevf = dlsym(RTLD_NEXT, "writev");
+  pwritevf = dlsym(RTLD_NEXT, "pwritev");
+  pwritev64f = dlsym(RTLD_NEXT, "pwritev64");
+  /* these are in librt on older systems, which the program might not use. */
+  aiowritef = dlsym(RTLD_NEXT, "aio_write");
+  aiowrite64f = dlsym(RTLD_NEXT, "aio_write64");
   assert(openf != NULL);
   assert(writef != NULL);
   assert(closef != NULL);
+  assert(lseekf != NULL);
+  assert(pwritef != NULL);
+  assert(writevf != NULL);
+  assert(pwritevf != NULL);
+  ofposix_init_table();
+  const char* zc = getenv("LIBSITU_ZEROCOPY");
+  if(zc) {
+    zerocopy_min = (size_t)strtoull(zc, NULL, 10);
+  }
 }
 
-int
-open(const char* fn, int flags, ...)
+static int
+open_common(const char* fn, int flags, mode_t mode, openfqn* realopen)
 {
-  mode_t mode = S_IRUSR | S_IWUSR;
-  if(flags & O_CREAT) {
-    va_list lst;
-    va_start(lst, flags);
-    mode = va_arg(lst, mode_t);
-    va_end(lst);
-  }
-  if(!matches(transferlibs, fn) || flags & O_RDONLY ||
+  if(suppressed || !matches(transferlibs, fn) ||
+     (flags & O_ACCMODE) == O_RDONLY ||
      strncmp(fn, "/tmp", 4) == 0 ||
      strncmp(fn, "/dev", 4) == 0) {
     TRACE(posix, "%s opened, but ignored by policy.", fn);
-    const int des = openf(fn, flags, mode);
+    const int des = realopen(fn, flags, mode);
     return des;
   }
-  const int des = openf(fn, flags, mode);
+  const int des = realopen(fn, flags, mode);
   if(des <= 0) { /* open failed; ignoring this file. */
     TRACE(posix, "posix-opening %s ignored due to open failure", fn);
     return des;
@@ -90,67 +283,370 @@ open(const char* fn, int flags, ...)
     TRACE(posix, "posix-opening %s...", fn);
   }
 
-  /* need an empty entry in the table to store the return value. */
-  int empty = 0;
-  struct openposixfile* of = ofposix_find(posix_files, fd_of, &empty);
+  struct openposixfile* of = calloc(1, sizeof(struct openposixfile));
   if(of == NULL) {
-    WARN(posix, "out of open files.  skipping '%s'", fn);
+    WARN(posix, "out of memory.  skipping '%s'", fn);
     return des;
   }
-  assert(of->name == NULL);
-  of->name = strdup(fn);
+  of->file = fpfile_open(transferlibs, fn);
   of->fd = des;
-  file(transferlibs, fn);
+  of->rfd = -1;
+  /* we follow the position ourselves from here on, rather than asking for it
+   * on every write.  appends go wherever the end happens to be. */
+  of->append = (flags & O_APPEND) != 0;
+  of->pos = of->append ? -1 : lseekf(des, 0, SEEK_CUR);
+  if(zerocopy_min > 0 && of->file != NULL && of->file->n > 0) {
+    struct stat st;
+    if(fstat(des, &st) == 0 && S_ISREG(st.st_mode)) {
+      of->rfd = realopen(fn, O_RDONLY | O_CLOEXEC);
+    }
+  }
+  if(of->file == NULL || !ofposix_claim(des, of)) {
+    WARN(posix, "could not track FD %d.  skipping '%s'", des, fn);
+    if(of->rfd != -1) { closef(of->rfd); }
+    fpfile_close(of->file);
+    free(of);
+    return des;
+  }
+  fpfile_file(of->file);
   return des;
 }
 
+int
+open(const char* fn, int flags, ...)
+{
+  mode_t mode = S_IRUSR | S_IWUSR;
+  if(flags & O_CREAT) {
+    va_list lst;
+    va_start(lst, flags);
+    mode = va_arg(lst, mode_t);
+    va_end(lst);
+  }
+  return open_common(fn, flags, mode, openf);
+}
+
+int
+open64(const char* fn, int flags, ...)
+{
+  mode_t mode = S_IRUSR | S_IWUSR;
+  if(flags & O_CREAT) {
+    va_list lst;
+    va_start(lst, flags);
+    mode = va_arg(lst, mode_t);
+    va_end(lst);
+  }
+  return open_common(fn, flags, mode, open64f ? open64f : openf);
+}
+
+/* It will cause us a lot of problems if a write ends up being short, and the
+ * application then resubmits the next part of the partial write.  So,
+ * iterate and make sure we avoid any partial writes.  This doesn't count
+ * towards the statistics; see write_fully. */
+static ssize_t
+write_all(int fd, const void* buf, size_t sz)
+{
+  ssize_t written = 0;
+  do {
+    errno=0;
+    ssize_t bytes = writef(fd, ((const char*)buf)+written, sz-written);
+    if(bytes == -1 && errno == EINTR) { continue; }
+    if(bytes == -1) { break; }
+    written += bytes;
+  } while((size_t)written < sz);
+  return written == 0 && sz > 0 ? -1 : written;
+}
+
+/* write_all, as one I/O call in the statistics. */
+static ssize_t
+write_fully(int fd, const void* buf, size_t sz)
+{
+  const uint64_t t0 = stats_start();
+  const ssize_t written = write_all(fd, buf, sz);
+  stats_io(IO_POSIX, t0, written > 0 ? (size_t)written : 0);
+  return written;
+}
+
+/* writes first, then gives the processors the pages we just wrote. */
+static ssize_t
+write_zerocopy(struct openposixfile* of, const void* buf, size_t sz, off_t off)
+{
+  const ssize_t written = write_fully(of->fd, buf, sz);
+  if(written <= 0) {
+    return written;
+  }
+  if(off == -1) { /* appending; we're just past what we wrote, though. */
+    const off_t end = lseekf(of->fd, 0, SEEK_CUR);
+    off = end == -1 ? -1 : end - (off_t)written;
+  }
+  struct fpbuf* b = NULL;
+  if(off != -1) {
+    b = fpbuf_map(of->rfd, off, (size_t)written);
+  }
+  if(b == NULL) { /* e.g. out of address space; copy after all. */
+    fpfile_stream_at(of->file, buf, (size_t)written, off);
+  } else {
+    fpfile_stream_buf(of->file, b, off);
+    fpbuf_unref(b);
+  }
+  return written;
+}
+
+/* moves our idea of the file position past a write at 'off'. */
+static void
+advance(struct openposixfile* of, off_t off, ssize_t written)
+{
+  if(off != -1 && written > 0) {
+    __atomic_store_n(&of->pos, off + written, __ATOMIC_RELAXED);
+  }
+}
+
 ssize_t
 write(int fd, const void *buf, size_t sz)
 {
-  struct openposixfile* of = ofposix_find(posix_files, fd_of, &fd);
+  struct openposixfile* of = ofposix_find(fd);
   if(of == NULL) {
     return writef(fd, buf, sz);
   }
   TRACE(posix, "writing %zu bytes to %d", sz, fd);
-  stream(transferlibs, of->name, buf, sz);
-  /* It will cause us a lot of problems if a write ends up being short, and the
-   * application then resubmits the next part of the partial write.  So,
-   * iterate and make sure we avoid any partial writes. */
-  {
-    ssize_t written = 0;
-    do {
-      errno=0;
-      ssize_t bytes = writef(fd, ((const char*)buf)+written, sz-written);
-      if(bytes == -1 && errno == EINTR) { continue; }
-      if(bytes == -1 && written == 0) { return -1; }
-      if(bytes == -1) { return written; }
-      written += bytes;
-    } while((size_t)written < sz);
-    return written;
+  const off_t off = __atomic_load_n(&of->pos, __ATOMIC_RELAXED);
+  ssize_t written;
+  if(of->rfd != -1 && sz >= zerocopy_min && async_enabled()) {
+    written = write_zerocopy(of, buf, sz, off);
+  } else {
+    fpfile_stream_at(of->file, buf, sz, off);
+    written = write_fully(fd, buf, sz);
   }
+  advance(of, off, written);
+  return written;
+}
+
+off_t
+lseek(int fd, off_t off, int whence)
+{
+  const off_t rv = lseekf(fd, off, whence);
+  struct openposixfile* of = ofposix_find(fd);
+  if(of != NULL && rv != -1 && !of->append) {
+    __atomic_store_n(&of->pos, rv, __ATOMIC_RELAXED);
+  }
+  return rv;
+}
+
+off64_t
+lseek64(int fd, off64_t off, int whence)
+{
+  const off64_t rv = lseek64f ? lseek64f(fd, off, whence) :
+                                lseekf(fd, (off_t)off, whence);
+  struct openposixfile* of = ofposix_find(fd);
+  if(of != NULL && rv != -1 && !of->append) {
+    __atomic_store_n(&of->pos, (off_t)rv, __ATOMIC_RELAXED);
+  }
+  return rv;
+}
+
+/* Programs compiled with _FILE_OFFSET_BITS=64 (HDF5, for one) call the '64'
+ * variants below instead.  They are the same on 64-bit systems, so each pair
+ * shares an implementation and just differs in what it calls afterwards. */
+
+/* the offset versions of write_all and write_fully. */
+static ssize_t
+pwrite_all(int fd, const void* buf, size_t sz, off_t off, bool large)
+{
+  ssize_t written = 0;
+  do {
+    errno=0;
+    const char* from = ((const char*)buf)+written;
+    ssize_t bytes = large ? pwrite64f(fd, from, sz-written, off+written) :
+                            pwritef(fd, from, sz-written, off+written);
+    if(bytes == -1 && errno == EINTR) { continue; }
+    if(bytes == -1) { break; }
+    written += bytes;
+  } while((size_t)written < sz);
+  return written == 0 && sz > 0 ? -1 : written;
+}
+
+static ssize_t
+pwrite_fully(int fd, const void* buf, size_t sz, off_t off, bool large)
+{
+  const uint64_t t0 = stats_start();
+  const ssize_t written = pwrite_all(fd, buf, sz, off, large);
+  stats_io(IO_POSIX, t0, written > 0 ? (size_t)written : 0);
+  return written;
+}
+
+static ssize_t
+pwrite_common(int fd, const void* buf, size_t sz, off_t off, bool large)
+{
+  struct openposixfile* of = ofposix_find(fd);
+  if(of != NULL) {
+    TRACE(posix, "pwriting %zu bytes to %d at %lld", sz, fd, (long long)off);
+    /* Linux appends, whatever 'off' says. */
+    fpfile_stream_at(of->file, buf, sz, of->append ? -1 : off);
+  } else if(!large) {
+    return pwritef(fd, buf, sz, off);
+  } else {
+    return pwrite64f(fd, buf, sz, off);
+  }
+  return pwrite_fully(fd, buf, sz, off, large);
+}
+
+ssize_t
+pwrite(int fd, const void* buf, size_t sz, off_t off)
+{
+  return pwrite_common(fd, buf, sz, off, false);
+}
+
+ssize_t
+pwrite64(int fd, const void* buf, size_t sz, off64_t off)
+{
+  if(pwrite64f == NULL) { /* no such thing on this system. */
+    return pwrite_common(fd, buf, sz, (off_t)off, false);
+  }
+  return pwrite_common(fd, buf, sz, (off_t)off, true);
+}
+
+/* finishes a short vectored write, starting 'done' bytes in.  The caller
+ * counts it, along with the first part. */
+static ssize_t
+writev_rest(int fd, const struct iovec* iov, int cnt, ssize_t done,
+            off_t off, bool large)
+{
+  ssize_t skip = done;
+  for(int i=0; i < cnt; ++i) {
+    if((size_t)skip >= iov[i].iov_len) {
+      skip -= (ssize_t)iov[i].iov_len;
+      continue;
+    }
+    const char* from = (const char*)iov[i].iov_base + skip;
+    const size_t n = iov[i].iov_len - (size_t)skip;
+    const ssize_t b = off == -1 ? write_all(fd, from, n) :
+                      pwrite_all(fd, from, n, off+done, large);
+    if(b == -1) { return done; }
+    done += b;
+    if((size_t)b < n) { return done; }
+    skip = 0;
+  }
+  return done;
+}
+
+static ssize_t
+writev_common(int fd, const struct iovec* iov, int cnt, off_t off,
+              bool large)
+{
+  struct openposixfile* of = ofposix_find(fd);
+  ssize_t bytes;
+  const bool positioned = off != -1;
+  if(of != NULL) {
+    TRACE(posix, "writing %d-entry gather list to %d", cnt, fd);
+    fpfile_stream_iov(of->file, iov, cnt, positioned && !of->append ? off :
+                      __atomic_load_n(&of->pos, __ATOMIC_RELAXED));
+  }
+  const uint64_t t0 = of != NULL ? stats_start() : 0;
+  do {
+    errno=0;
+    if(off == -1) {
+      bytes = writevf(fd, iov, cnt);
+    } else {
+      bytes = large ? pwritev64f(fd, iov, cnt, off) :
+                      pwritevf(fd, iov, cnt, off);
+    }
+  } while(bytes == -1 && errno == EINTR && of != NULL);
+  if(of == NULL || bytes == -1) {
+    stats_io(IO_POSIX, t0, 0);
+    return bytes;
+  }
+  /* as in 'write': no partial writes the processors might see twice. */
+  const ssize_t written = writev_rest(fd, iov, cnt, bytes, off, large);
+  stats_io(IO_POSIX, t0, (size_t)written);
+  if(!positioned) {
+    advance(of, __atomic_load_n(&of->pos, __ATOMIC_RELAXED), written);
+  }
+  return written;
+}
+
+ssize_t
+writev(int fd, const struct iovec* iov, int cnt)
+{
+  return writev_common(fd, iov, cnt, -1, false);
+}
+
+ssize_t
+pwritev(int fd, const struct iovec* iov, int cnt, off_t off)
+{
+  return writev_common(fd, iov, cnt, off, false);
+}
+
+ssize_t
+pwritev64(int fd, const struct iovec* iov, int cnt, off64_t off)
+{
+  return writev_common(fd, iov, cnt, (off_t)off, pwritev64f != NULL);
+}
+
+/* the processors see the data when the write is queued.  The program may not
+ * touch the buffer until the write completes, so that's as good a time as
+ * any, and saves us tracking completions. */
+static void
+aio_stream(int fd, volatile void* buf, size_t sz, off_t off)
+{
+  struct openposixfile* of = ofposix_find(fd);
+  if(of == NULL) {
+    return;
+  }
+  if(of->append) { /* the offset is ignored, then. */
+    off = -1;
+  }
+  TRACE(posix, "aio writing %zu bytes to %d at %lld", sz, fd, (long long)off);
+  fpfile_stream_at(of->file, (const void*)buf, sz, off);
+}
+
+int
+aio_write(struct aiocb* cb)
+{
+  if(aiowritef == NULL) {
+    aiowritef = dlsym(RTLD_NEXT, "aio_write");
+    if(aiowritef == NULL) {
+      errno = ENOSYS;
+      return -1;
+    }
+  }
+  aio_stream(cb->aio_fildes, cb->aio_buf, cb->aio_nbytes, cb->aio_offset);
+  return aiowritef(cb);
+}
+
+int
+aio_write64(struct aiocb64* cb)
+{
+  if(aiowrite64f == NULL) {
+    aiowrite64f = dlsym(RTLD_NEXT, "aio_write64");
+    if(aiowrite64f == NULL) {
+      errno = ENOSYS;
+      return -1;
+    }
+  }
+  aio_stream(cb->aio_fildes, cb->aio_buf, cb->aio_nbytes,
+             (off_t)cb->aio_offset);
+  return aiowrite64f(cb);
 }
 
 int
 close(int des)
 {
-  struct openposixfile* of = ofposix_find(posix_files, fd_of, &des);
-  if(of == NULL) {
+  if(ofposix_find(des) == NULL) {
     TRACE(posix, "don't know FD %d; skipping 'close' instrumentation.", des);
     return closef(des);
   }
-  TRACE(posix, "closing %s (FD %d [%d])", of->name, des, of->fd);
-  assert(of->fd == des);
-  if(of->name == NULL) { /* don't bother, not a real file? */
-    WARN(posix, "null filename!?");
+  struct openposixfile* of = ofposix_release(des);
+  if(of == NULL) { /* another thread closed it first. */
     return closef(des);
   }
+  TRACE(posix, "closing %s (FD %d [%d])", of->file->name, des, of->fd);
+  assert(of->fd == des);
 
-  finish(transferlibs, of->name);
+  fpfile_finish(of->file);
 
-  { /* free up rid of table entry */
-    free(of->name);
-    of->name = NULL;
-    of->fd = 0;
+  fpfile_close(of->file);
+  if(of->rfd != -1) {
+    closef(of->rfd);
   }
+  free(of);
   return closef(des);
 }
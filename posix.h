@@ -0,0 +1,13 @@
+/* Hooks into the POSIX interposer for the other interposers. */
+#ifndef FREEPROC_POSIX_H
+#define FREEPROC_POSIX_H
+
+#include <stdbool.h>
+
+/* While set, files this thread opens are not tracked.  I/O libraries that we
+ * already intercept at a higher level (MPI-IO, say) open and write files via
+ * POSIX calls themselves; tracking those too would hand processors the same
+ * data twice. */
+void posix_suppress(bool);
+
+#endif
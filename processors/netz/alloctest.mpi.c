@@ -0,0 +1,93 @@
+/* Checks that netz doesn't allocate memory for each write it intercepts, once
+ * it is going.  We count the malloc/calloc/realloc calls netz makes while we
+ * feed it a restart file, after the first few writes; there should be none.
+ * Only calls from our own executable count: the C library's AIO, for one,
+ * manages its own request pool and threads as it sees fit.
+ * Run it in a scratch directory: it writes header.txt, psiphi.cfg, and the
+ * outputs there. */
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <mpi.h>
+#include "parallel.mpi.h"
+
+extern void exec(const char*, const void*, size_t n);
+extern void finish(const char*);
+
+extern void* __libc_malloc(size_t);
+extern void* __libc_calloc(size_t, size_t);
+extern void* __libc_realloc(void*, size_t);
+
+extern char __executable_start;
+extern char etext;
+
+static bool counting = false;
+static size_t nallocs = 0;
+
+/* counts an allocation made from 'caller', if it's one we care about. */
+static inline void
+count(const void* caller)
+{
+  if(counting && (const char*)caller >= &__executable_start &&
+     (const char*)caller < &etext) {
+    __atomic_add_fetch(&nallocs, 1, __ATOMIC_RELAXED);
+  }
+}
+
+void*
+malloc(size_t n)
+{
+  count(__builtin_return_address(0));
+  return __libc_malloc(n);
+}
+void*
+calloc(size_t n, size_t sz)
+{
+  count(__builtin_return_address(0));
+  return __libc_calloc(n, sz);
+}
+void*
+realloc(void* p, size_t n)
+{
+  count(__builtin_return_address(0));
+  return __libc_realloc(p, n);
+}
+
+enum { BX=64, BY=32, BZ=16, NF=2, CHUNK=4096, WARMUP=4 };
+
+int
+main(int argc, char* argv[])
+{
+  MPI_Init(&argc, &argv);
+  if(rank() == 0) {
+    FILE* fp = fopen("header.txt", "w");
+    fprintf(fp, "nG=0\nImaAll=%d\nJmaAll=%d\nKmaAll=%d\nnF=%d\n"
+            "dimsI=%zu\ndimsJ=1\ndimsK=1\nFieldNames\nAAAA\nBBBB\n",
+            BX, BY, BZ, NF, size());
+    fclose(fp);
+    fp = fopen("psiphi.cfg", "w");
+    fprintf(fp, "slices = [\n x = 5\n y = 7\n z = 3 ]\nBBBB { 3d }\n");
+    fclose(fp);
+    finish("header.txt");
+  }
+
+  const size_t n = (size_t)NF*BX*BY*BZ*sizeof(float);
+  char* buf = calloc(n, 1);
+  char fn[64];
+  snprintf(fn, 64, "RestartFile.Rank%zu", rank());
+  for(size_t off=0, i=0; off < n; off += CHUNK, ++i) {
+    counting = i >= WARMUP;
+    exec(fn, buf+off, n-off < CHUNK ? n-off : CHUNK);
+  }
+  counting = false;
+  finish(fn);
+  free(buf);
+
+  const size_t total = nallocs;
+  printf("[%zu] %zu allocations in %zu intercepted writes\n", rank(), total,
+         (n+CHUNK-1)/CHUNK - WARMUP);
+  MPI_Finalize();
+  return total == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
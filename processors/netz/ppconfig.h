@@ -2,7 +2,8 @@
 #define FREEPROCESSING_PSIPHI_CONFIG_H
 
 enum Axis { X=0, Y=1, Z=2 };
-/* desired slice information: {Y, 5} means the 5th slice of the Y axis.  We
+/* desired slice information: {Y, 5} means the 5th slice of the Y axis of the
+ * whole domain, i.e. the plane of elements whose global y coordinate is 5.  We
  * parse the information on which slice[s] the user wants from the config file.
  */
 struct slice {
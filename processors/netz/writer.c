@@ -0,0 +1,414 @@
+#define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+#include <aio.h>
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef HAVE_LINUX_IO_URING_H
+# include <linux/io_uring.h>
+# include <sys/mman.h>
+# include <sys/syscall.h>
+#endif
+#include "debug.h"
+#include "writer.h"
+
+DECLARE_CHANNEL(writer);
+
+struct slot {
+  /* where the slot's data goes.  cb.aio_nbytes is how much of 'buf' is used.
+   * the io_uring backend only uses the aiocb as a description. */
+  struct aiocb cb;
+  char* buf;
+  bool busy; /* submitted, not yet reaped */
+};
+struct uring;
+struct writer {
+  size_t nslots;
+  size_t extent; /* size of each slot's buffer */
+  struct slot* slots;
+  /* slots are used round-robin, so 'cur' is also the one after the newest in
+   * flight, and the next one we'd wait for. */
+  size_t cur;
+  bool filling; /* 'cur' has data but has not been submitted */
+  bool failed;
+  struct uring* ring; /* NULL: we use POSIX AIO. */
+};
+
+/* writes the slot's data from byte 'done' on, synchronously. */
+static void
+write_rest(struct writer* w, const struct slot* s, size_t done)
+{
+  while(done < s->cb.aio_nbytes) {
+    const ssize_t b = pwrite(s->cb.aio_fildes, s->buf + done,
+                             s->cb.aio_nbytes - done,
+                             s->cb.aio_offset + (off_t)done);
+    if(b == -1 && errno == EINTR) {
+      continue;
+    }
+    if(b <= 0) {
+      ERR(writer, "write at %jd failed: %d",
+          (intmax_t)(s->cb.aio_offset + (off_t)done), errno);
+      w->failed = true;
+      return;
+    }
+    done += (size_t)b;
+  }
+}
+
+/* a write finished; 'res' is how it went: bytes, or -errno. */
+static void
+completed(struct writer* w, struct slot* s, ssize_t res)
+{
+  s->busy = false;
+  if(res < 0) {
+    ERR(writer, "write of %zu bytes at %jd failed: %d", s->cb.aio_nbytes,
+        (intmax_t)s->cb.aio_offset, (int)-res);
+    w->failed = true;
+    return;
+  }
+  write_rest(w, s, (size_t)res); /* if it was short. */
+}
+
+#ifdef HAVE_LINUX_IO_URING_H
+/* We talk to the kernel directly rather than through liburing; we need very
+ * little of it.  Each slot has at most one write in flight, so a ring with as
+ * many entries as we have slots never fills up.  The SQ index array maps
+ * entry i to SQE i once, at setup, and is never touched again. */
+struct uring {
+  int fd;
+  unsigned* sqtail;
+  unsigned sqmask;
+  struct io_uring_sqe* sqes;
+  unsigned* cqhead;
+  unsigned* cqtail;
+  unsigned cqmask;
+  struct io_uring_cqe* cqes;
+  void* sqring; size_t sqlen;
+  void* cqring; size_t cqlen; /* == sqring with IORING_FEAT_SINGLE_MMAP */
+  size_t sqeslen;
+  unsigned tosubmit; /* in the ring, but the kernel hasn't been told */
+  unsigned batch; /* tell the kernel once this many are waiting */
+};
+
+static void
+uring_destroy(struct uring* r)
+{
+  if(r->sqes != NULL && r->sqes != MAP_FAILED) {
+    munmap(r->sqes, r->sqeslen);
+  }
+  if(r->cqring != NULL && r->cqring != MAP_FAILED && r->cqring != r->sqring) {
+    munmap(r->cqring, r->cqlen);
+  }
+  if(r->sqring != NULL && r->sqring != MAP_FAILED) {
+    munmap(r->sqring, r->sqlen);
+  }
+  close(r->fd);
+  free(r);
+}
+
+/* io_uring came in 5.1, but IORING_OP_WRITE only in 5.6; earlier kernels
+ * fail every write with EINVAL.  The probe came along with it, so a kernel
+ * that can't answer can't write either. */
+static bool
+uring_can_write(int fd)
+{
+  const unsigned nops = 256;
+  struct io_uring_probe* probe = calloc(1, sizeof(struct io_uring_probe) +
+                                        nops*sizeof(struct io_uring_probe_op));
+  if(probe == NULL) {
+    return false;
+  }
+  const bool rv =
+    syscall(SYS_io_uring_register, fd, IORING_REGISTER_PROBE, probe,
+            nops) == 0 &&
+    IORING_OP_WRITE <= probe->last_op &&
+    (probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED);
+  free(probe);
+  return rv;
+}
+
+static struct uring*
+uring_create(unsigned entries)
+{
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  struct uring* r = calloc(1, sizeof(struct uring));
+  if(r == NULL) {
+    return NULL;
+  }
+  r->fd = (int)syscall(SYS_io_uring_setup, entries, &p);
+  if(r->fd == -1) { /* old kernel, or forbidden by seccomp/sysctl */
+    TRACE(writer, "no io_uring: %d", errno);
+    free(r);
+    return NULL;
+  }
+  if(!uring_can_write(r->fd)) {
+    TRACE(writer, "io_uring can't write here; not using it.");
+    close(r->fd);
+    free(r);
+    return NULL;
+  }
+  r->sqlen = p.sq_off.array + p.sq_entries*sizeof(unsigned);
+  r->cqlen = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+  if(p.features & IORING_FEAT_SINGLE_MMAP) {
+    r->sqlen = r->cqlen = r->sqlen > r->cqlen ? r->sqlen : r->cqlen;
+  }
+  r->sqring = mmap(NULL, r->sqlen, PROT_READ|PROT_WRITE,
+                   MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+  if(p.features & IORING_FEAT_SINGLE_MMAP) {
+    r->cqring = r->sqring;
+  } else {
+    r->cqring = mmap(NULL, r->cqlen, PROT_READ|PROT_WRITE,
+                     MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+  }
+  r->sqeslen = p.sq_entries*sizeof(struct io_uring_sqe);
+  r->sqes = mmap(NULL, r->sqeslen, PROT_READ|PROT_WRITE,
+                 MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_SQES);
+  if(r->sqring == MAP_FAILED || r->cqring == MAP_FAILED ||
+     r->sqes == MAP_FAILED) {
+    WARN(writer, "could not map io_uring: %d", errno);
+    uring_destroy(r);
+    return NULL;
+  }
+  char* sq = r->sqring;
+  char* cq = r->cqring;
+  r->sqtail = (unsigned*)(sq + p.sq_off.tail);
+  r->sqmask = *(unsigned*)(sq + p.sq_off.ring_mask);
+  unsigned* array = (unsigned*)(sq + p.sq_off.array);
+  for(unsigned i=0; i < p.sq_entries; ++i) {
+    array[i] = i;
+  }
+  r->cqhead = (unsigned*)(cq + p.cq_off.head);
+  r->cqtail = (unsigned*)(cq + p.cq_off.tail);
+  r->cqmask = *(unsigned*)(cq + p.cq_off.ring_mask);
+  r->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+  r->batch = entries > 1 ? entries / 2 : 1;
+  return r;
+}
+
+/* tells the kernel about what's queued, and waits for at least 'wait'
+ * completions.  @returns false if the ring is unusable. */
+static bool
+uring_enter(struct writer* w, unsigned wait)
+{
+  struct uring* r = w->ring;
+  const unsigned flags = wait > 0 ? IORING_ENTER_GETEVENTS : 0;
+  const long n = syscall(SYS_io_uring_enter, r->fd, r->tosubmit, wait, flags,
+                         NULL, 0);
+  if(n == -1 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+    ERR(writer, "io_uring_enter failed: %d", errno);
+    return false;
+  }
+  if(n > 0) {
+    r->tosubmit -= (unsigned)n;
+  }
+  return true;
+}
+
+/* handles every completion that is waiting. */
+static void
+uring_reap(struct writer* w)
+{
+  struct uring* r = w->ring;
+  unsigned head = *r->cqhead;
+  const unsigned tail = __atomic_load_n(r->cqtail, __ATOMIC_ACQUIRE);
+  for(; head != tail; ++head) {
+    const struct io_uring_cqe* cqe = &r->cqes[head & r->cqmask];
+    assert(cqe->user_data < w->nslots);
+    completed(w, &w->slots[cqe->user_data], cqe->res);
+  }
+  __atomic_store_n(r->cqhead, head, __ATOMIC_RELEASE);
+}
+
+static void
+uring_submit(struct writer* w, size_t slot)
+{
+  struct uring* r = w->ring;
+  const struct slot* s = &w->slots[slot];
+  const unsigned tail = *r->sqtail;
+  struct io_uring_sqe* sqe = &r->sqes[tail & r->sqmask];
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+  sqe->opcode = IORING_OP_WRITE;
+  sqe->fd = s->cb.aio_fildes;
+  sqe->off = (uint64_t)s->cb.aio_offset;
+  sqe->addr = (uint64_t)(uintptr_t)s->buf;
+  sqe->len = (uint32_t)s->cb.aio_nbytes;
+  sqe->user_data = slot;
+  __atomic_store_n(r->sqtail, tail+1, __ATOMIC_RELEASE);
+  if(++r->tosubmit >= r->batch && !uring_enter(w, 0)) {
+    w->failed = true;
+  }
+}
+
+/* @returns false if the ring broke before 's' completed. */
+static bool
+uring_wait(struct writer* w, struct slot* s)
+{
+  uring_reap(w);
+  while(s->busy) {
+    if(!uring_enter(w, 1)) {
+      return false;
+    }
+    uring_reap(w);
+  }
+  return true;
+}
+#else
+struct uring { int unused; };
+static struct uring* uring_create(unsigned e) { (void)e; return NULL; }
+static void uring_destroy(struct uring* r) { (void)r; }
+static void uring_submit(struct writer* w, size_t s) { (void)w; (void)s; }
+static bool uring_wait(struct writer* w, struct slot* s) {
+  (void)w; (void)s; return false;
+}
+#endif
+
+struct writer*
+writer_create(size_t nslots, size_t extent, bool uring)
+{
+  assert(nslots > 0 && extent > 0);
+  struct writer* w = calloc(1, sizeof(struct writer));
+  if(w == NULL) {
+    return NULL;
+  }
+  w->nslots = nslots;
+  w->extent = extent;
+  w->slots = calloc(nslots, sizeof(struct slot));
+  if(w->slots == NULL) {
+    free(w);
+    return NULL;
+  }
+  for(size_t i=0; i < nslots; ++i) {
+    if((w->slots[i].buf = malloc(extent)) == NULL) {
+      writer_destroy(w);
+      return NULL;
+    }
+  }
+  if(uring) {
+    w->ring = uring_create((unsigned)nslots);
+  }
+  TRACE(writer, "%zu %zu-byte writes via %s", nslots, extent,
+        w->ring ? "io_uring" : "POSIX AIO");
+  return w;
+}
+
+void
+writer_destroy(struct writer* w)
+{
+  if(w == NULL) {
+    return;
+  }
+  writer_flush(w);
+  if(w->ring) {
+    uring_destroy(w->ring);
+  }
+  for(size_t i=0; i < w->nslots; ++i) {
+    free(w->slots[i].buf);
+  }
+  free(w->slots);
+  free(w);
+}
+
+bool
+writer_uring(const struct writer* w)
+{
+  return w->ring != NULL;
+}
+
+/* waits for the slot's write to finish, and finishes it ourselves if it was
+ * short. */
+static void
+reap(struct writer* w, struct slot* s)
+{
+  if(!s->busy) {
+    return;
+  }
+  if(w->ring) {
+    if(!uring_wait(w, s)) { /* we can't know; write it (again) ourselves. */
+      completed(w, s, 0);
+    }
+    return;
+  }
+  const struct aiocb* list[1] = { &s->cb };
+  int err;
+  while((err = aio_error(&s->cb)) == EINPROGRESS) {
+    if(aio_suspend(list, 1, NULL) != 0 && errno != EINTR) {
+      ERR(writer, "aio_suspend failed: %d", errno);
+    }
+  }
+  const ssize_t bytes = aio_return(&s->cb);
+  completed(w, s, err != 0 ? -err : bytes);
+}
+
+/* sends off the slot being filled and moves on to the next one. */
+static void
+submit(struct writer* w)
+{
+  if(!w->filling) {
+    return;
+  }
+  struct slot* s = &w->slots[w->cur];
+  s->busy = true;
+  if(w->ring) {
+    uring_submit(w, w->cur);
+  } else {
+    s->cb.aio_buf = s->buf;
+    s->cb.aio_sigevent.sigev_notify = SIGEV_NONE;
+    if(aio_write(&s->cb) != 0) {
+      /* e.g. EAGAIN: the system has enough going on; do it now. */
+      TRACE(writer, "aio_write failed (%d); writing synchronously", errno);
+      completed(w, s, 0);
+    }
+  }
+  w->filling = false;
+  w->cur = (w->cur + 1) % w->nslots;
+}
+
+void
+writer_put(struct writer* w, int fd, off_t off, const void* buf, size_t n)
+{
+  const char* b = buf;
+  while(n > 0) {
+    struct slot* s = &w->slots[w->cur];
+    if(w->filling && (s->cb.aio_fildes != fd ||
+                      s->cb.aio_offset + (off_t)s->cb.aio_nbytes != off)) {
+      submit(w); /* not adjacent; can't extend it. */
+      s = &w->slots[w->cur];
+    }
+    if(!w->filling) {
+      reap(w, s); /* the oldest write; we need its buffer. */
+      s->cb.aio_fildes = fd;
+      s->cb.aio_offset = off;
+      s->cb.aio_nbytes = 0;
+      w->filling = true;
+    }
+    const size_t room = w->extent - s->cb.aio_nbytes;
+    const size_t len = n < room ? n : room;
+    memcpy(s->buf + s->cb.aio_nbytes, b, len);
+    s->cb.aio_nbytes += len;
+    b += len;
+    off += (off_t)len;
+    n -= len;
+    if(s->cb.aio_nbytes == w->extent) {
+      submit(w);
+    }
+  }
+}
+
+bool
+writer_flush(struct writer* w)
+{
+  submit(w);
+  for(size_t i=0; i < w->nslots; ++i) {
+    reap(w, &w->slots[i]);
+  }
+  const bool ok = !w->failed;
+  w->failed = false;
+  return ok;
+}
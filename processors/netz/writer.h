@@ -0,0 +1,34 @@
+/* A small pool of asynchronous writes.  Data handed to writer_put is copied
+ * into one of a fixed number of extent buffers; pieces that land right after
+ * the previous one in the same file are appended to it, so a run of scanlines
+ * that is contiguous on disk goes out as one write.  A full extent is
+ * submitted and we move on to the next buffer, waiting for the oldest write
+ * only when every buffer is in flight.  Memory use is therefore bounded by
+ * nslots*extent, however much is written.
+ * Writes go through io_uring where the kernel lets us, and POSIX AIO
+ * otherwise.  With io_uring, submissions are batched: the kernel hears about
+ * them once half the slots are queued, or when we need to wait. */
+#ifndef FREEPROC_NETZ_WRITER_H
+#define FREEPROC_NETZ_WRITER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+struct writer;
+
+/** 'uring': try io_uring before falling back to POSIX AIO.
+ * @returns NULL if memory is short. */
+struct writer* writer_create(size_t nslots, size_t extent, bool uring);
+/** waits for outstanding writes, then frees everything. */
+void writer_destroy(struct writer*);
+/** @returns true if writes go through io_uring. */
+bool writer_uring(const struct writer*);
+/** queues 'n' bytes of 'buf' for 'fd' at 'off'.  'buf' may be reused as soon
+ * as this returns. */
+void writer_put(struct writer*, int fd, off_t off, const void* buf, size_t n);
+/** submits anything pending and waits for all of it.
+ * @returns false if any write since the last flush failed. */
+bool writer_flush(struct writer*);
+
+#endif
@@ -1,16 +1,22 @@
-#define _POSIX_C_SOURCE 200801L
-#define _BSD_SOURCE 1
+#define _GNU_SOURCE 1
 #include <ctype.h>
 #include <errno.h>
+#include <poll.h>
+#include <pthread.h>
 #include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
 #include "launcher.h"
 #include "debug.h"
+#include "spawner.h"
 
 DECLARE_CHANNEL(consumer);
 
@@ -23,28 +29,6 @@ ignore_children()
   sigaction(SIGCLD, &nocld, NULL);
 }
 
-/* get rid of all the environment variables we don't *need* to run. */
-static void
-simplify_env()
-{
-  unsetenv("LD_PRELOAD");
-  const char* home = getenv("HOME");
-  const char* path = getenv("PATH");
-  const char* display = getenv("DISPLAY");
-  if(clearenv() != 0) {
-    fprintf(stderr, "Could not clear environment..");
-  }
-  if(setenv("PATH", path, 1) != 0) {
-    fprintf(stderr, "setenv PATH failed.\n");
-  }
-  if(setenv("HOME", home, 1) != 0) {
-    fprintf(stderr, "setenv HOME failed.\n");
-  }
-  if(display && setenv("DISPLAY", display, 1) != 0) {
-    fprintf(stderr, "setenv DISPLAY failed.\n");
-  }
-}
-
 static void reap();
 static void reap_sync(pid_t);
 typedef void (ryecatch)(pid_t);
@@ -135,38 +119,453 @@ count(const char* s, charfunc predicate) {
   return n;
 }
 
+/* The consumer scheduler.  Without it, every file starts a consumer at once;
+ * if files are produced faster than they are consumed, consumers pile up and
+ * take the simulation's cores.  The scheduler runs no more than
+ * LIBSITU_CONSUMERS at a time.  The rest wait, and LIBSITU_CONSUMER_POLICY
+ * says what happens while they do:
+ *   "queue": all of them run eventually, in order.  The default.
+ *   "drop-oldest": at most LIBSITU_CONSUMER_QUEUE wait; when another comes,
+ *                  the one that has waited longest is forgotten.
+ *   "coalesce": a new command replaces a waiting one of the same pattern,
+ *               i.e. that differs only in its numbers: 'viz out0042.h5'
+ *               replaces 'viz out0041.h5'.  Only the newest data is shown.
+ * Synchronous requests (LIBSITU_SYNC) are never dropped or replaced.
+ *
+ * We talk to the scheduler over a socketpair, one command line per packet,
+ * prefixed by 's' if we want to hear when the consumer is done or 'a' if
+ * not.  It runs in a thread of ours, or, with LIBSITU_PREFORK, in a helper
+ * process.  We don't fork consumers (see spawner.h), but some MPIs object to
+ * any child sharing our memory, even briefly.  So we fork the helper while we
+ * are still small (we're loaded before the simulation's main) and it starts
+ * consumers for us.  Finished consumers are noticed via pidfds, so neither the
+ * scheduler nor the simulation ever has to sit in a wait. */
+enum Policy { POLICY_QUEUE=0, POLICY_DROP_OLDEST, POLICY_COALESCE };
+struct job {
+  char* cmd; /* leading 's' or 'a', then the command line */
+  char* key; /* the command with numbers blanked out, for coalescing */
+  struct job* next;
+};
+/* what the scheduler tells us about a consumer that finished. */
+struct reply {
+  pid_t pid;
+  int status; /* as from waitpid */
+};
+struct running {
+  pid_t pid;
+  int pidfd; /* -1 if the system doesn't have them */
+  bool reply;
+};
+struct sched {
+  size_t max; /* consumers at once */
+  enum Policy policy;
+  size_t maxqueue; /* DROP_OLDEST: waiting consumers we keep */
+  struct running* run;
+  size_t nrun;
+  struct job* head;
+  struct job** tail;
+  size_t nqueued;
+  size_t dropped; /* ... or replaced */
+};
+static int schedfd = -1;
+static pthread_t schedthread;
+static bool threaded = false;
+/* a synchronous request and its reply must not interleave with another. */
+static pthread_mutex_t sched_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t
+env_size(const char* var, size_t dflt)
+{
+  const char* c = getenv(var);
+  const long n = c ? strtol(c, NULL, 10) : 0;
+  return n > 0 ? (size_t)n : dflt;
+}
+
+static enum Policy
+policy()
+{
+  const char* p = getenv("LIBSITU_CONSUMER_POLICY");
+  if(p == NULL || strcmp(p, "queue") == 0) {
+    return POLICY_QUEUE;
+  } else if(strcmp(p, "drop-oldest") == 0) {
+    return POLICY_DROP_OLDEST;
+  } else if(strcmp(p, "coalesce") == 0) {
+    return POLICY_COALESCE;
+  }
+  WARN(consumer, "unknown policy '%s'; queueing everything.", p);
+  return POLICY_QUEUE;
+}
+
+static int
+pidfd_of(pid_t pid)
+{
+#ifdef SYS_pidfd_open
+  return (int)syscall(SYS_pidfd_open, pid, 0);
+#else
+  (void)pid;
+  return -1;
+#endif
+}
+
+/* 'cmd' with every run of digits replaced by one '#'. */
+static char*
+pattern_of(const char* cmd)
+{
+  char* key = malloc(strlen(cmd)+1);
+  if(key == NULL) {
+    return NULL;
+  }
+  char* k = key;
+  for(const char* c=cmd; *c; ) {
+    if(isdigit((unsigned char)*c)) {
+      *k++ = '#';
+      while(isdigit((unsigned char)*c)) { ++c; }
+    } else {
+      *k++ = *c++;
+    }
+  }
+  *k = '\0';
+  return key;
+}
+
+static void
+free_job(struct job* j)
+{
+  free(j->cmd);
+  free(j->key);
+  free(j);
+}
+
+/* removes and returns the first job waiting. */
+static struct job*
+dequeue(struct sched* s)
+{
+  struct job* j = s->head;
+  s->head = j->next;
+  if(s->head == NULL) { s->tail = &s->head; }
+  --s->nqueued;
+  return j;
+}
+
+/* queues the job, per the policy. */
+static void
+enqueue(struct sched* s, struct job* j)
+{
+  if(j->cmd[0] == 'a' && s->policy == POLICY_COALESCE) {
+    for(struct job* q=s->head; q != NULL; q=q->next) {
+      if(q->cmd[0] == 'a' && strcmp(q->key, j->key) == 0) {
+        TRACE(consumer, "'%s' replaces '%s'", j->cmd+1, q->cmd+1);
+        free(q->cmd);
+        q->cmd = j->cmd; /* keeps q's place in line. */
+        j->cmd = NULL;
+        free_job(j);
+        ++s->dropped;
+        return;
+      }
+    }
+  }
+  if(j->cmd[0] == 'a' && s->policy == POLICY_DROP_OLDEST &&
+     s->nqueued >= s->maxqueue) {
+    struct job** p = &s->head; /* the oldest we're allowed to drop. */
+    while(*p != NULL && (*p)->cmd[0] != 'a') { p = &(*p)->next; }
+    if(*p != NULL) {
+      struct job* old = *p;
+      *p = old->next;
+      if(s->tail == &old->next) { s->tail = p; }
+      --s->nqueued;
+      TRACE(consumer, "dropping '%s'", old->cmd+1);
+      free_job(old);
+      ++s->dropped;
+    }
+  }
+  j->next = NULL;
+  *s->tail = j;
+  s->tail = &j->next;
+  ++s->nqueued;
+}
+
+/* what consumers get for an environment; made once, the first time. */
+static char** consumer_env = NULL;
+static pthread_once_t env_once = PTHREAD_ONCE_INIT;
+static void
+build_env()
+{
+  consumer_env = minimal_env(NULL);
+}
+
+/* starts a consumer.  @returns its pid, or -1. */
+static pid_t
+start(const char* cmd)
+{
+  pthread_once(&env_once, build_env);
+  const size_t ntokens = count(cmd, isspace);
+  char** tokens = malloc(sizeof(char*) * (ntokens+2));
+  char* line = strdup(cmd);
+  if(tokens == NULL || line == NULL || consumer_env == NULL) {
+    ERR(consumer, "out of memory; not starting '%s'", cmd);
+    free(tokens); free(line);
+    return -1;
+  }
+  tokenize(line, tokens);
+  /* Restrictions in OMPI mean that, after a fork, we can't assume any pages
+   * are writable!  So we don't fork; see spawner.h. */
+  const pid_t pid = spawn(tokens, consumer_env, false);
+  if(pid == -1) {
+    ERR(consumer, "could not start %s: %d", tokens[0], errno);
+  }
+  free(line);
+  free(tokens);
+  return pid;
+}
+
+static void
+respond(int sock, pid_t pid, int status)
+{
+  const struct reply rep = { pid, status };
+  if(send(sock, &rep, sizeof(rep), MSG_NOSIGNAL) != sizeof(rep)) {
+    WARN(consumer, "could not report on consumer %d: %d", (int)pid, errno);
+  }
+}
+
+/* starts waiting consumers while there is room. */
+static void
+dispatch(struct sched* s, int sock)
+{
+  while(s->nrun < s->max && s->head != NULL) {
+    struct job* j = dequeue(s);
+    const pid_t pid = start(j->cmd+1);
+    if(pid != -1) {
+      struct running* r = &s->run[s->nrun++];
+      r->pid = pid;
+      r->pidfd = pidfd_of(pid);
+      r->reply = j->cmd[0] == 's';
+    } else if(j->cmd[0] == 's') {
+      respond(sock, 0, 127 << 8); /* as if exec failed */
+    }
+    free_job(j);
+  }
+}
+
+/* runs requests from 'sock' until the other end is closed.  'linger': keep
+ * to the limit after that, until every consumer asked for is done; else
+ * start everything still waiting at once, and leave the rest be. */
+static void
+schedule(int sock, bool linger)
+{
+  struct sched s = {
+    .max = env_size("LIBSITU_CONSUMERS", 2), .policy = policy(),
+    .maxqueue = env_size("LIBSITU_CONSUMER_QUEUE", 4), .nrun = 0,
+    .head = NULL, .nqueued = 0, .dropped = 0
+  };
+  s.tail = &s.head;
+  s.run = calloc(s.max, sizeof(struct running));
+  struct pollfd* pfd = calloc(s.max+1, sizeof(struct pollfd));
+  if(s.run == NULL || pfd == NULL) {
+    ERR(consumer, "out of memory; no consumers will run.");
+    free(s.run);
+    free(pfd);
+    return;
+  }
+  bool open = true;
+  while(open || s.head != NULL || (linger && s.nrun > 0)) {
+    if(!open && !linger) {
+      while(s.head != NULL) {
+        struct job* j = dequeue(&s);
+        if(start(j->cmd+1) == -1 && j->cmd[0] == 's') {
+          respond(sock, 0, 127 << 8);
+        }
+        free_job(j);
+      }
+      break;
+    }
+    dispatch(&s, sock);
+    /* without pidfds, we look for finished consumers every so often. */
+    int timeout = -1;
+    for(size_t i=0; i < s.nrun; ++i) {
+      pfd[i] = (struct pollfd){ s.run[i].pidfd, POLLIN, 0 };
+      if(s.run[i].pidfd == -1) { timeout = 50; }
+    }
+    const size_t sockidx = s.nrun; /* reaping below changes s.nrun */
+    pfd[sockidx] = (struct pollfd){ open ? sock : -1, POLLIN, 0 };
+    if(poll(pfd, s.nrun+1, timeout) == -1) {
+      continue; /* EINTR */
+    }
+    for(size_t i=s.nrun; i-- > 0; ) {
+      if(s.run[i].pidfd != -1 && pfd[i].revents == 0) {
+        continue;
+      }
+      int status = 0;
+      if(waitpid(s.run[i].pid, &status, WNOHANG) == 0) {
+        continue; /* still running */
+      }
+      if(s.run[i].reply) {
+        respond(sock, s.run[i].pid, status);
+      }
+      if(s.run[i].pidfd != -1) {
+        close(s.run[i].pidfd);
+      }
+      s.run[i] = s.run[--s.nrun];
+    }
+    if(open && (pfd[sockidx].revents & (POLLIN|POLLHUP))) {
+      char buf[4096];
+      const ssize_t n = recv(sock, buf, sizeof(buf)-1, MSG_DONTWAIT);
+      if(n == 0 || (n == -1 && errno != EINTR && errno != EAGAIN)) {
+        open = false;
+        continue;
+      }
+      if(n <= 0) {
+        continue;
+      }
+      buf[n] = '\0';
+      struct job* j = calloc(1, sizeof(struct job));
+      if(j == NULL || (j->cmd = strdup(buf)) == NULL ||
+         (j->key = pattern_of(buf+1)) == NULL) {
+        if(j) { free(j->cmd); }
+        free(j);
+        continue;
+      }
+      enqueue(&s, j);
+    }
+  }
+  if(s.dropped > 0) {
+    WARN(consumer, "%zu consumers were dropped or replaced, because files "
+         "came faster than they were consumed.", s.dropped);
+  }
+  for(size_t i=0; i < s.nrun; ++i) {
+    if(s.run[i].pidfd != -1) {
+      close(s.run[i].pidfd);
+    }
+  }
+  free(s.run);
+  free(pfd);
+}
+
+static void*
+schedule_thread(void* sock)
+{
+  schedule((int)(intptr_t)sock, false);
+  return NULL;
+}
+
+/* runs when we're loaded, which is while the simulation is starting up. */
+__attribute__((constructor(300))) static void
+start_scheduler()
+{
+  const char* pf = getenv("LIBSITU_PREFORK");
+  const bool prefork = pf != NULL && *pf != '\0' && strcmp(pf, "0") != 0;
+  if(!prefork && getenv("LIBSITU_CONSUMERS") == NULL) {
+    return; /* the old way: every consumer right away. */
+  }
+  int sv[2];
+  if(socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) != 0) {
+    WARN(consumer, "no socketpair (%d); consumers will not be scheduled.",
+         errno);
+    return;
+  }
+  if(prefork) {
+    fflush(stdout); /* else the helper would print it again. */
+    const pid_t pid = fork();
+    if(pid == 0) {
+      close(sv[0]);
+      signal(SIGCHLD, SIG_DFL);
+      schedule(sv[1], true);
+      fflush(stdout); /* our messages. */
+      _exit(EXIT_SUCCESS);
+    }
+    if(pid != -1) {
+      close(sv[1]);
+      schedfd = sv[0];
+      TRACE(consumer, "helper %d will start consumers", (int)pid);
+      return;
+    }
+    WARN(consumer, "could not fork helper (%d); scheduling in a thread.",
+         errno);
+  }
+  /* the thread takes no signals; they are the simulation's business. */
+  sigset_t all, prev;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &prev);
+  threaded = pthread_create(&schedthread, NULL, schedule_thread,
+                            (void*)(intptr_t)sv[1]) == 0;
+  pthread_sigmask(SIG_SETMASK, &prev, NULL);
+  if(!threaded) {
+    close(sv[0]);
+    close(sv[1]);
+    return;
+  }
+  schedfd = sv[0];
+}
+
+/* in threaded mode, consumers still waiting are started before we go, all at
+ * once, as without a scheduler; we don't wait for any of them to finish.  a
+ * helper outlives us, and keeps to the limit until it has run them all. */
+__attribute__((destructor)) static void
+stop_scheduler()
+{
+  if(schedfd == -1) {
+    return;
+  }
+  if(threaded) {
+    shutdown(schedfd, SHUT_WR);
+    pthread_join(schedthread, NULL);
+    threaded = false;
+  }
+  close(schedfd);
+  schedfd = -1;
+}
+
+/* @returns false if the scheduler is gone, and we should start it ourselves. */
+static bool
+launch_scheduled(const char* cmdline)
+{
+  const bool sync = getenv("LIBSITU_SYNC") != NULL;
+  const size_t len = strlen(cmdline);
+  char* msg = malloc(len+2);
+  if(msg == NULL) {
+    return false;
+  }
+  msg[0] = sync ? 's' : 'a';
+  memcpy(msg+1, cmdline, len+1);
+  bool ok;
+  pthread_mutex_lock(&sched_lock);
+  ok = send(schedfd, msg, len+1, MSG_NOSIGNAL) == (ssize_t)(len+1);
+  if(ok && sync) {
+    struct reply rep;
+    ssize_t n;
+    while((n = recv(schedfd, &rep, sizeof(rep), 0)) == -1 && errno == EINTR) {
+      ;
+    }
+    ok = n == (ssize_t)sizeof(rep);
+    if(ok) {
+      waitpid_err(rep.pid, rep.status);
+    }
+  }
+  if(!ok) {
+    WARN(consumer, "lost the consumer scheduler (%d); starting consumers "
+         "directly.", errno);
+    close(schedfd);
+    schedfd = -1;
+  }
+  pthread_mutex_unlock(&sched_lock);
+  free(msg);
+  return ok;
+}
+
 void
 launch(const char* cmdline)
 {
-  /* We fix our environment in the child, but at the very least we want to stop
-   * tracing opens/closes for the consumer process */
-  unsetenv("LD_PRELOAD");
+  if(schedfd != -1 && launch_scheduled(cmdline)) {
+    return;
+  }
   /* ignore children exiting, but not if we're synchronous---then we need to
    * track children so we can grab e.g. their exit status, later. */
   if(getenv("LIBSITU_SYNC") == NULL) {
     ignore_children(); /* attempt to ignore children, to prevent zombies. */
   }
-
-  /* get our command line into a form we can exec easily. */
-  const size_t ntokens = count(cmdline, isspace);
-  char** tokens = malloc(sizeof(char*) * (ntokens+1));
-  tokenize((char*)cmdline, tokens);
-
-  pid_t pid = fork();
-  /* Restrictions in OMPI mean that, after a fork, we can't assume any pages
-   * are writable!  This basically means we must immediately exec.  Hence why
-   * we fixed our environment up front. */
+  const pid_t pid = start(cmdline);
   if(pid == -1) {
-    ERR(consumer, "Could not fork vis process: %d\n", errno);
     return;
   }
-  if(pid == 0) {
-    simplify_env();
-    execv(tokens[0], tokens);
-    ERR(consumer, "could not exec pvbatch: %d\n", errno);
-    return;
-  }
-  free(tokens);
   /* This is joyful.  As sigaction(2) says:
    *   "the only completely portable method of ensuring that terminated
    *    children do not become zombies is to catch the SIGCHLD signal and
@@ -5,9 +5,25 @@
  *                     appended as the final argument.  Required.
  *   LIBSITU_SYNC: if set, then consuming is synchronous with production.
  *                 Optional.
- * Be careful.  There is no consumer constraints without _SYNC, so if your
- * producer creates products (closes files) faster than your consumers can
- * consume them, you can quickly overload your system. */
+ *   LIBSITU_CONSUMERS: if set, at most this many consumers run at once;
+ *                      more wait their turn.  Optional.
+ *   LIBSITU_CONSUMER_POLICY: what to do with consumers that are waiting:
+ *                            "queue" (the default) runs them all, in order;
+ *                            "drop-oldest" keeps at most
+ *                            LIBSITU_CONSUMER_QUEUE (default 4) of them;
+ *                            "coalesce" replaces a waiting command with a
+ *                            newer one that only differs in its numbers
+ *                            (e.g. the timestep).  Optional.
+ *   LIBSITU_PREFORK: if set (and not 0), consumers are started by a helper
+ *                    process we fork at startup, instead of by forking the
+ *                    (by then large) simulation.  Implies LIBSITU_CONSUMERS,
+ *                    which then defaults to 2.  Optional.
+ * When the simulation exits, consumers still waiting are started right away,
+ * and it does not wait for them; a LIBSITU_PREFORK helper instead keeps to
+ * the limit, after the simulation is gone.
+ * Be careful.  There are no consumer constraints without _SYNC or
+ * _CONSUMERS, so if your producer creates products (closes files) faster than
+ * your consumers can consume them, you can quickly overload your system. */
 #define _POSIX_C_SOURCE 200812L
 #include <stdio.h>
 #include <stdlib.h>
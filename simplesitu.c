@@ -6,8 +6,11 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include "async.h"
 #include "debug.h"
 #include "fproc.h"
+#include "idmap.h"
+#include "stats.h"
 
 DECLARE_CHANNEL(generic);
 DECLARE_CHANNEL(opens);
@@ -17,60 +20,35 @@ typedef FILE* (fopenfqn)(const char*, const char*);
 typedef size_t (fwritefqn)(const void*, size_t, size_t, FILE*);
 typedef int (fclosefqn)(FILE*);
 
-typedef void* MPI_Comm;
-typedef void* MPI_Info;
-typedef void* MPI_File;
-typedef int (mpi_file_openfqn)(MPI_Comm, char*, int, MPI_Info, MPI_File*);
-
 static fopenfqn* fopenf = NULL;
 static fwritefqn* fwritef = NULL;
 static fclosefqn* fclosef = NULL;
-static mpi_file_openfqn* mpi_file_openf = NULL;
 
 /* When the file is closed, we need the filename so we can pass it to the vis
  * code.  But we're only given the filename on open, not close.  This table
- * maps FILE*s to filenames, which we populate on open.
- * \note This is *not* currently thread-safe. */
+ * maps FILE*s to filenames, which we populate on open.  Every fwrite consults
+ * it, and usually about a stream we don't track (stdout, say), so it is a
+ * hash table rather than an array we'd need to scan.  The table is
+ * thread-safe, and lookups (i.e. every fwrite) never take a lock. */
 struct openfile {
-  char* name;
+  struct fpfile* file; /* the file's name and processors */
   FILE* fp;
 };
-struct openmpifile {
-  char* name;
-  MPI_File* fp;
-};
-#define MAX_FILES 1024
-static const size_t N_SPACES = MAX_FILES;
-static struct openfile files[MAX_FILES] = {{NULL, NULL}};
-static struct openmpifile mpifiles[MAX_FILES] = {{NULL, NULL}};
-
-typedef int (ofpredicate)(const struct openfile*, const void*);
-
-/* find the openfile in the 'arr'ay which matches the 'p'redicate.
- * 'userdata' is the 'p'redicate's second argument */
-static struct openfile*
-of_find(struct openfile* arr, ofpredicate * const p, const void* userdata)
-{
-  for(size_t i=0; i < MAX_FILES; ++i) {
-    if(p(&arr[i], userdata)) {
-      return &arr[i];
-    }
-  }
-  return NULL;
-}
-static int
-fp_of(const struct openfile* f, const void* fp)
-{
-  return f->fp == fp;
-}
+static struct idmap files = IDMAP_INITIALIZER;
 
 __attribute__((destructor)) static void
 free_processors() /* ha, ha */
 {
+  stats_shutdown();
+  async_shutdown();
+  /* before unloading: the dump names the processors' libraries. */
+  stats_dump("exit");
   unload_processors(transferlibs);
 }
 
-__attribute__((constructor(200))) static void
+/* after the other interposers are set up: loading processors runs their
+ * constructors, which may already open, write or close files. */
+__attribute__((constructor(260))) static void
 fp_init()
 {
   /* make sure we don't instrument any more children. */
@@ -81,7 +59,6 @@ fp_init()
   fopenf = dlsym(RTLD_NEXT, "fopen");
   fwritef = dlsym(RTLD_NEXT, "fwrite");
   fclosef = dlsym(RTLD_NEXT, "fclose");
-  mpi_file_openf = dlsym(RTLD_NEXT, "MPI_File_open");
   assert(fopenf != NULL);
   assert(fclosef != NULL);
 
@@ -99,6 +76,7 @@ fp_init()
   }
   load_processors(transferlibs, cfg);
   fclose(cfg);
+  async_init();
 }
 
 FILE*
@@ -112,38 +90,44 @@ fopen(const char* name, const char* mode)
   }
   TRACE(opens, "opening %s", name);
 
-  /* need an empty entry in the table to store the return value. */
-  struct openfile* of = of_find(files, fp_of, NULL);
-  if(of == NULL) {
-    WARN(opens, "internal table overflow.  skipping '%s'", name);
-    return fopenf(name, mode);
+  FILE* fp = fopenf(name, mode);
+  if(fp == NULL) {
+    return NULL;
   }
-  assert(of->fp == NULL);
-  of->name = strdup(name);
-  of->fp = fopenf(name, mode);
-  /* if the open failed, then we have some spare memory lying around for the
-   * filename.  It'll never get freed, because an "empty entry" in the table is
-   * just a NULL fp, and so we can't differentiate between the cases.  So free
-   * up our string now. */
-  if(of->fp == NULL) {
-    free(of->name); of->name = NULL;
+  struct openfile* of = malloc(sizeof(struct openfile));
+  if(of == NULL || (of->file = fpfile_open(transferlibs, name)) == NULL) {
+    WARN(opens, "out of memory.  skipping '%s'", name);
+    free(of);
+    return fp;
   }
-  file(transferlibs, name);
-  return of->fp;
+  of->fp = fp;
+  if(!idmap_put(&files, (uintptr_t)fp, of)) {
+    WARN(opens, "internal table overflow.  skipping '%s'", name);
+    fpfile_close(of->file);
+    free(of);
+    return fp;
+  }
+  fpfile_file(of->file);
+  return fp;
 }
 
 size_t
 fwrite(const void* buf, size_t n, size_t nmemb, FILE* fp)
 {
   assert(fwritef != NULL);
-  struct openfile* of = of_find(files, fp_of, fp);
+  const struct openfile* of = idmap_get(&files, (uintptr_t)fp);
   if(of == NULL) {
     TRACE(writes, "I don't know %p.  Ignoring.", fp);
     return fwritef(buf, n, nmemb, fp);
   }
-  stream(transferlibs, of->name, buf, n*nmemb);
-  TRACE(writes, "writing %zu*%zu bytes to %s", n,nmemb, of->name);
-  return fwritef(buf, n, nmemb, fp);
+  /* asking for the position costs a little, so only do it when needed. */
+  const off_t off = of->file->offsets ? ftello(fp) : -1;
+  fpfile_stream_at(of->file, buf, n*nmemb, off);
+  TRACE(writes, "writing %zu*%zu bytes to %s", n,nmemb, of->file->name);
+  const uint64_t t0 = stats_start();
+  const size_t rv = fwritef(buf, n, nmemb, fp);
+  stats_io(IO_STDIO, t0, rv*n);
+  return rv;
 }
 
 int
@@ -151,53 +135,19 @@ fclose(FILE* fp)
 {
   /* only happens if fqn pointers don't load. */
   if(fclosef == NULL) { fp_init(); }
-  struct openfile* of = of_find(files, fp_of, fp);
+  struct openfile* of = idmap_del(&files, (uintptr_t)fp);
   if(of == NULL) {
     TRACE(opens, "I don't know %p.  Ignoring.", fp);
     return fclosef(fp);
   }
   assert(of->fp == fp);
-  assert(of->name != NULL);
-  TRACE(opens, "fclosing %p (%s)", fp, of->name);
+  TRACE(opens, "fclosing %p (%s)", fp, of->file->name);
   const int rv = fclosef(fp);
   if(rv != 0) {
     WARN(opens, "close failure! (%d)", rv);
   }
-  finish(transferlibs, of->name);
-  of->fp = NULL;
-  free(of->name);
-  of->name = NULL;
-  return rv;
-}
-
-int MPI_File_open(MPI_Comm comm, char* filename, int amode,
-                  MPI_Info info, MPI_File* fh)
-{
-  TRACE(opens, "mpi_file_open(%s, %d)", filename, amode);
-  assert(mpi_file_openf != NULL);
-  #define MPI_MODE_WRONLY 4 /* hack! */
-  WARN(opens, "write detection is based on OMPI-specific hack..");
-  if((amode & MPI_MODE_WRONLY) == 0) {
-    TRACE(opens, "simulation output would probably be write-only.  "
-          "File %s was opened %d, and so we are ignoring it for in-situ.",
-          filename, amode);
-    return mpi_file_openf(comm, filename, amode, info, fh);
-  }
-  /* find an empty spot in the table for this file. */
-  struct openmpifile* of = (struct openmpifile*) of_find(
-    (struct openfile*)mpifiles, fp_of, NULL
-  );
-  if(of == NULL) { /* table full?  then just ignore it. */
-    WARN(opens, "out of open mpi files.  skipping '%s'", filename);
-    return mpi_file_openf(comm, filename, amode, info, fh);
-  }
-  assert(of->fp == NULL);
-  of->name = strdup(filename);
-  const int rv = mpi_file_openf(comm, filename, amode, info, fh);
-  of->fp = fh;
-  if(of->fp == NULL) {
-    free(of->name); of->name = NULL;
-  }
-
+  fpfile_finish(of->file);
+  fpfile_close(of->file);
+  free(of);
   return rv;
 }
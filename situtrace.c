@@ -0,0 +1,358 @@
+/* Turns binary traces (see trace.h) into a Chrome trace: a JSON timeline that
+ * chrome://tracing or Perfetto can display.  Give it every ring from the run,
+ * e.g. from all ranks:
+ *
+ *   situtrace run.*.trc > timeline.json
+ *
+ * Records from all rings are merged by timestamp.  Each process gets its own
+ * row, labelled with its MPI rank where we know it; processes forked from a
+ * rank inherit the rank, so they also say whom they were forked from.  Call
+ * sites are read from the .sites file next to each ring. */
+#define _GNU_SOURCE 1
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "trace.h"
+
+struct site {
+  char* channel;
+  char* func;
+  char* fmt;
+};
+/* the call sites one process registered. */
+struct sites {
+  int64_t pid;
+  size_t n; /* entries in 'site'; indexed by id */
+  struct site* site;
+};
+static struct sites* tables = NULL;
+static size_t ntables = 0;
+
+struct event {
+  const struct trace_header* hdr;
+  const struct site* site; /* NULL if we can't find it */
+  struct trace_record rec;
+};
+
+/* undoes the escaping in trace.c, in place. */
+static char*
+unescape(char* s)
+{
+  char* o = s;
+  for(const char* i=s; *i; ++i) {
+    if(*i == '\\' && i[1]) {
+      ++i;
+      *o++ = *i == 't' ? '\t' : *i == 'n' ? '\n' : *i;
+    } else {
+      *o++ = *i;
+    }
+  }
+  *o = '\0';
+  return s;
+}
+
+/* @returns the sites of 'pid', whose files start with 'prefix', loading them
+ * if need be.  The table is empty if there is no file. */
+static const struct sites*
+sites_of(const char* prefix, int64_t pid)
+{
+  for(size_t i=0; i < ntables; ++i) {
+    if(tables[i].pid == pid) {
+      return &tables[i];
+    }
+  }
+  tables = realloc(tables, (ntables+1) * sizeof(struct sites));
+  struct sites* t = &tables[ntables++];
+  t->pid = pid;
+  t->n = 0;
+  t->site = NULL;
+  char fn[4096];
+  snprintf(fn, sizeof(fn), "%s.%" PRId64 ".sites", prefix, pid);
+  FILE* fp = fopen(fn, "r");
+  if(fp == NULL) {
+    return t;
+  }
+  char* line = NULL;
+  size_t len = 0;
+  while(getline(&line, &len, fp) != -1) {
+    line[strcspn(line, "\n")] = '\0';
+    char* save = NULL;
+    const char* id = strtok_r(line, "\t", &save);
+    char* ch = strtok_r(NULL, "\t", &save);
+    char* func = strtok_r(NULL, "\t", &save);
+    char* fmt = strtok_r(NULL, "\t", &save);
+    if(id == NULL || ch == NULL || func == NULL) {
+      continue;
+    }
+    const size_t i = strtoul(id, NULL, 10);
+    if(i >= t->n) {
+      t->site = realloc(t->site, (i+1) * sizeof(struct site));
+      memset(t->site + t->n, 0, (i+1 - t->n) * sizeof(struct site));
+      t->n = i+1;
+    }
+    t->site[i].channel = strdup(unescape(ch));
+    t->site[i].func = strdup(unescape(func));
+    t->site[i].fmt = strdup(fmt ? unescape(fmt) : "");
+  }
+  free(line);
+  fclose(fp);
+  return t;
+}
+
+/* finds call site 'id' of the ring's process, or of whoever it was forked
+ * from. */
+static const struct site*
+find_site(const char* prefix, const struct trace_header* h, uint32_t id)
+{
+  const struct sites* t = sites_of(prefix, h->pid);
+  if(id < t->n && t->site[id].fmt != NULL) {
+    return &t->site[id];
+  }
+  for(size_t i=0; i < TRACE_LINEAGE && h->lineage[i] != 0; ++i) {
+    t = sites_of(prefix, h->lineage[i]);
+    if(id < t->n && t->site[id].fmt != NULL) {
+      return &t->site[id];
+    }
+  }
+  return NULL;
+}
+
+/* reads a whole ring. */
+static struct trace_header*
+load(const char* fn)
+{
+  FILE* fp = fopen(fn, "rb");
+  if(fp == NULL) {
+    fprintf(stderr, "could not open %s\n", fn);
+    return NULL;
+  }
+  struct trace_header h;
+  if(fread(&h, sizeof(h), 1, fp) != 1 ||
+     memcmp(h.magic, TRACE_MAGIC, sizeof(h.magic)) != 0 ||
+     h.recsize != sizeof(struct trace_record)) {
+    fprintf(stderr, "%s is not a trace we understand\n", fn);
+    fclose(fp);
+    return NULL;
+  }
+  const size_t bytes = sizeof(h) + (size_t)h.cap * h.recsize;
+  struct trace_header* all = malloc(bytes);
+  if(all == NULL) {
+    fclose(fp);
+    return NULL;
+  }
+  rewind(fp);
+  const size_t got = fread(all, 1, bytes, fp);
+  fclose(fp);
+  if(got != bytes) {
+    fprintf(stderr, "%s is truncated\n", fn);
+    free(all);
+    return NULL;
+  }
+  return all;
+}
+
+static int
+by_time(const void* a, const void* b)
+{
+  const uint64_t x = ((const struct event*)a)->rec.ns;
+  const uint64_t y = ((const struct event*)b)->rec.ns;
+  return x < y ? -1 : x > y ? 1 : 0;
+}
+
+/* prints 's' as the contents of a JSON string. */
+static void
+json_str(FILE* out, const char* s)
+{
+  for(; *s; ++s) {
+    const unsigned char c = (unsigned char)*s;
+    if(c == '"' || c == '\\') {
+      fprintf(out, "\\%c", c);
+    } else if(c < 0x20) {
+      fprintf(out, "\\u%04x", c);
+    } else {
+      fputc(c, out);
+    }
+  }
+}
+
+/* formats the message the way symb_dbg would have, from what we kept. */
+static void
+format(char* out, size_t cap, const char* fmt, const struct trace_record* r)
+{
+  unsigned char kinds[TRACE_NARGS];
+  const unsigned nkinds = trace_parse(fmt, kinds);
+  unsigned a = 0; /* next argument */
+  size_t len = 0;
+  for(const char* f=fmt; *f && len+1 < cap; ) {
+    if(*f != '%') {
+      out[len++] = *f++;
+      continue;
+    }
+    if(f[1] == '%') {
+      out[len++] = '%';
+      f += 2;
+      continue;
+    }
+    /* rebuild the conversion: '*'s become the recorded numbers, length
+     * modifiers go, and the value is passed as a type we choose. */
+    char spec[64] = "%";
+    size_t sl = 1;
+    const char* c = f+1;
+    for(; *c && strchr("#0- +'.0123456789*hlqLzjt", *c) && sl < 40; ++c) {
+      if(*c == '*') {
+        const int w = a < r->nargs ? (int)r->args[a] : 0;
+        ++a;
+        sl += (size_t)snprintf(spec+sl, sizeof(spec)-sl, "%d", w);
+      } else if(!strchr("hlqLzjt", *c)) {
+        spec[sl++] = *c;
+      }
+    }
+    const char conv = *c;
+    f = *c ? c+1 : c;
+    const int idx = (int)a++;
+    if(idx >= (int)r->nargs || idx >= (int)nkinds) {
+      len += (size_t)snprintf(out+len, cap-len, "?");
+      continue;
+    }
+    const uint64_t v = r->args[idx];
+    int w = 0;
+    switch(kinds[idx]) {
+      case TA_DOUBLE: case TA_LDOUBLE: {
+        double d;
+        memcpy(&d, &v, sizeof(d));
+        spec[sl++] = conv; spec[sl] = '\0';
+        w = snprintf(out+len, cap-len, spec, d);
+        break;
+      }
+      case TA_PTR:
+        spec[sl++] = 'p'; spec[sl] = '\0';
+        w = snprintf(out+len, cap-len, spec, (void*)(uintptr_t)v);
+        break;
+      case TA_STR: {
+        char s[sizeof(v)+4];
+        memcpy(s, &v, sizeof(v));
+        s[sizeof(v)] = '\0';
+        if(strlen(s) == sizeof(v)) { /* we only kept the start of it. */
+          strcat(s, "...");
+        }
+        spec[sl++] = 's'; spec[sl] = '\0';
+        w = snprintf(out+len, cap-len, spec, s);
+        break;
+      }
+      default:
+        if(conv == 'c') {
+          spec[sl++] = 'c'; spec[sl] = '\0';
+          w = snprintf(out+len, cap-len, spec, (int)v);
+        } else {
+          spec[sl++] = 'l'; spec[sl++] = 'l'; spec[sl++] = conv;
+          spec[sl] = '\0';
+          w = snprintf(out+len, cap-len, spec, (long long)v);
+        }
+        break;
+    }
+    len += w > 0 ? (size_t)w : 0;
+    if(len >= cap) { len = cap-1; }
+  }
+  out[len < cap ? len : cap-1] = '\0';
+}
+
+static const char*
+class_name(unsigned cls)
+{
+  static const char* names[] = { "err", "warn", "trace", "fixme" };
+  return cls < 4 ? names[cls] : "?";
+}
+
+int
+main(int argc, char* argv[])
+{
+  if(argc < 2) {
+    fprintf(stderr, "usage: %s prefix.pid.tid.trc ... > timeline.json\n",
+            argv[0]);
+    return EXIT_FAILURE;
+  }
+  struct event* ev = NULL;
+  size_t nev = 0;
+  struct trace_header** rings = calloc((size_t)argc, sizeof(void*));
+  for(int i=1; i < argc; ++i) {
+    struct trace_header* h = rings[i] = load(argv[i]);
+    if(h == NULL) {
+      continue;
+    }
+    /* the prefix is the name without ".<pid>.<tid>.trc". */
+    char* prefix = strdup(argv[i]);
+    for(int dots=0; dots < 3; ++dots) {
+      char* d = strrchr(prefix, '.');
+      if(d != NULL) { *d = '\0'; }
+    }
+    /* the slot after the newest may be half overwritten when the ring has
+     * wrapped; skip it. */
+    const uint64_t n = h->head < h->cap ? h->head : h->cap - 1;
+    const struct trace_record* rec = (const struct trace_record*)(h+1);
+    ev = realloc(ev, (nev + n) * sizeof(struct event));
+    for(uint64_t r = h->head - n; r < h->head; ++r) {
+      ev[nev].hdr = h;
+      ev[nev].rec = rec[r % h->cap];
+      ev[nev].site = find_site(prefix, h, ev[nev].rec.site);
+      ++nev;
+    }
+    free(prefix);
+  }
+  qsort(ev, nev, sizeof(struct event), by_time);
+
+  FILE* out = stdout;
+  fprintf(out, "{\"traceEvents\": [\n");
+  bool first = true;
+  for(int i=1; i < argc; ++i) {
+    const struct trace_header* h = rings[i];
+    if(h == NULL) { continue; }
+    bool named = false; /* by another of its threads' rings */
+    for(int j=1; j < i && !named; ++j) {
+      named = rings[j] != NULL && rings[j]->pid == h->pid;
+    }
+    if(named) { continue; }
+    fprintf(out, "%s{\"ph\": \"M\", \"name\": \"process_name\", \"pid\": %"
+            PRId64 ", \"args\": {\"name\": \"", first ? "" : ",\n", h->pid);
+    if(h->rank >= 0) {
+      fprintf(out, "rank %" PRId64 ", ", h->rank);
+    }
+    fprintf(out, "pid %" PRId64, h->pid);
+    if(h->lineage[0] != 0) {
+      fprintf(out, ", forked from %" PRId64, h->lineage[0]);
+    }
+    fprintf(out, "\"}}");
+    first = false;
+  }
+  const uint64_t t0 = nev > 0 ? ev[0].rec.ns : 0;
+  for(size_t i=0; i < nev; ++i) {
+    const struct trace_header* h = ev[i].hdr;
+    const struct site* s = ev[i].site;
+    char msg[1024];
+    if(s != NULL) {
+      format(msg, sizeof(msg), s->fmt, &ev[i].rec);
+    } else {
+      snprintf(msg, sizeof(msg), "unknown call site %u", ev[i].rec.site);
+    }
+    fprintf(out, "%s{\"name\": \"", first ? "" : ",\n");
+    json_str(out, s ? s->func : "?");
+    fprintf(out, "\", \"cat\": \"");
+    json_str(out, s ? s->channel : "?");
+    fprintf(out, "\", \"ph\": \"i\", \"s\": \"t\", \"ts\": %.3f, \"pid\": %"
+            PRId64 ", \"tid\": %" PRId64 ", \"args\": {\"class\": \"%s\", "
+            "\"msg\": \"", (ev[i].rec.ns - t0) / 1e3,
+            h->pid, h->tid,
+            class_name(ev[i].rec.cls));
+    json_str(out, msg);
+    fprintf(out, "\"}}");
+    first = false;
+  }
+  fprintf(out, "\n], \"displayTimeUnit\": \"ns\"}\n");
+  for(int i=1; i < argc; ++i) {
+    free(rings[i]);
+  }
+  free(rings);
+  free(ev);
+  return EXIT_SUCCESS;
+}
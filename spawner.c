@@ -0,0 +1,79 @@
+/* Starting programs cheaply; see spawner.h. */
+#define _GNU_SOURCE 1
+#include <errno.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "spawner.h"
+
+char**
+minimal_env(const char* const extra[])
+{
+  const char* keep[] = { "PATH", "HOME", "DISPLAY" };
+  const size_t nkeep = sizeof(keep) / sizeof(keep[0]);
+  size_t nextra = 0;
+  while(extra && extra[nextra]) { ++nextra; }
+  char** env = calloc(nkeep + nextra + 1, sizeof(char*));
+  if(env == NULL) {
+    return NULL;
+  }
+  size_t n = 0;
+  for(size_t i=0; i < nkeep; ++i) {
+    const char* v = getenv(keep[i]);
+    if(v == NULL) {
+      continue;
+    }
+    const size_t len = strlen(keep[i]) + 1 + strlen(v) + 1;
+    if((env[n] = malloc(len)) == NULL) {
+      free_env(env);
+      return NULL;
+    }
+    snprintf(env[n++], len, "%s=%s", keep[i], v);
+  }
+  for(size_t i=0; i < nextra; ++i) {
+    if((env[n++] = strdup(extra[i])) == NULL) {
+      free_env(env);
+      return NULL;
+    }
+  }
+  return env;
+}
+
+void
+free_env(char** env)
+{
+  for(char** e=env; e && *e; ++e) {
+    free(*e);
+  }
+  free(env);
+}
+
+pid_t
+spawn(char* const argv[], char* const env[], bool search)
+{
+  posix_spawnattr_t attr;
+  int err = posix_spawnattr_init(&attr);
+  if(err != 0) {
+    errno = err;
+    return -1;
+  }
+  /* whatever we block or catch, the child starts afresh. */
+  sigset_t none, all;
+  sigemptyset(&none);
+  sigfillset(&all);
+  posix_spawnattr_setsigmask(&attr, &none);
+  posix_spawnattr_setsigdefault(&attr, &all);
+  posix_spawnattr_setflags(&attr, POSIX_SPAWN_USEVFORK |
+                           POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+  pid_t pid;
+  err = search ? posix_spawnp(&pid, argv[0], NULL, &attr, argv, env) :
+                 posix_spawn(&pid, argv[0], NULL, &attr, argv, env);
+  posix_spawnattr_destroy(&attr);
+  if(err != 0) {
+    errno = err;
+    return -1;
+  }
+  return pid;
+}
@@ -0,0 +1,25 @@
+/* Starting a program from a large process.  fork() copies the parent's page
+ * tables, which for a simulation with many GB of heap takes hundreds of
+ * milliseconds, and some MPIs don't cope with the copy-on-write pages
+ * afterwards.  Instead we posix_spawn with POSIX_SPAWN_USEVFORK: the child
+ * borrows our memory until it execs, so starting it costs the same whatever
+ * our size.  Since the child can't safely do anything before the exec, its
+ * environment is built up front, in the parent. */
+#ifndef FREEPROC_SPAWNER_H
+#define FREEPROC_SPAWNER_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+/** @returns an environment with just our PATH, HOME and DISPLAY, plus the
+ * "NAME=value" strings in 'extra' (NULL-terminated; may be NULL).  Free it
+ * with free_env.  NULL if we ran out of memory. */
+char** minimal_env(const char* const extra[]);
+void free_env(char** env);
+
+/** starts argv[0] with the environment 'env', looking for it in PATH if
+ * 'search' is set.  Signals the child gets are as if it was just started.
+ * @returns the child's pid, or -1 and sets errno. */
+pid_t spawn(char* const argv[], char* const env[], bool search);
+
+#endif
@@ -0,0 +1,365 @@
+/* Performance counters; see stats.h. */
+#define _GNU_SOURCE 1
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#include "async.h"
+#include "debug.h"
+#include "stats.h"
+#include "trace.h"
+
+DECLARE_CHANNEL(stats);
+
+struct counter {
+  uint64_t calls;
+  uint64_t bytes;
+  uint64_t ns; /* total */
+  uint64_t max_ns; /* longest single call */
+};
+
+bool stats_on = false;
+static char* prefix = NULL;
+static struct counter procs[MAX_FREEPROCS][ST_NOPS];
+static struct counter io[IO_NKINDS];
+static const char* opnames[ST_NOPS] = { "exec", "metadata", "region",
+                                        "finish" };
+static const char* ionames[IO_NKINDS] = { "posix", "stdio", "mpiio", "hdf5" };
+
+/* the signal handler can't do much, so a thread waits for it and dumps. */
+static sem_t wakeup;
+static pthread_t dumper;
+static bool listening = false;
+static bool stopping = false;
+/* one dump at a time. */
+static pthread_mutex_t dump_lock = PTHREAD_MUTEX_INITIALIZER;
+
+uint64_t
+stats_now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  /* never 0, which means 'not counting'. */
+  return (uint64_t)ts.tv_sec*1000000000ULL + (uint64_t)ts.tv_nsec + 1;
+}
+
+static void
+count(struct counter* c, uint64_t t0, size_t bytes)
+{
+  const uint64_t ns = stats_now() - t0;
+  __atomic_fetch_add(&c->calls, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&c->bytes, bytes, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&c->ns, ns, __ATOMIC_RELAXED);
+  uint64_t mx = __atomic_load_n(&c->max_ns, __ATOMIC_RELAXED);
+  while(ns > mx && !__atomic_compare_exchange_n(&c->max_ns, &mx, ns, true,
+                                                __ATOMIC_RELAXED,
+                                                __ATOMIC_RELAXED)) {
+    ;
+  }
+}
+
+void
+stats_processor(const struct teelib* tl, enum StatOp op, uint64_t t0,
+                size_t bytes)
+{
+  /* only the processors from situ.cfg are counted. */
+  const uintptr_t i = ((uintptr_t)tl - (uintptr_t)transferlibs) /
+                      sizeof(struct teelib);
+  if(t0 == 0 || i >= MAX_FREEPROCS) {
+    return;
+  }
+  count(&procs[i][op], t0, bytes);
+}
+
+void
+stats_io(enum StatIO kind, uint64_t t0, size_t bytes)
+{
+  if(t0 != 0) {
+    count(&io[kind], t0, bytes);
+  }
+}
+
+/* prints 's' as a JSON string. */
+static void
+json_str(FILE* out, const char* s)
+{
+  fputc('"', out);
+  for(; *s; ++s) {
+    const unsigned char c = (unsigned char)*s;
+    if(c == '"' || c == '\\') {
+      fprintf(out, "\\%c", c);
+    } else if(c < 0x20) {
+      fprintf(out, "\\u%04x", c);
+    } else {
+      fputc(c, out);
+    }
+  }
+  fputc('"', out);
+}
+
+static void
+json_counter(FILE* out, const char* name, const struct counter* c)
+{
+  fprintf(out, "\"%s\": {\"calls\": %" PRIu64 ", \"bytes\": %" PRIu64 ", "
+          "\"seconds\": %.9f, \"max_seconds\": %.9f}", name,
+          __atomic_load_n(&c->calls, __ATOMIC_RELAXED),
+          __atomic_load_n(&c->bytes, __ATOMIC_RELAXED),
+          __atomic_load_n(&c->ns, __ATOMIC_RELAXED) / 1e9,
+          __atomic_load_n(&c->max_ns, __ATOMIC_RELAXED) / 1e9);
+}
+
+/* the file a processor was loaded from. */
+static const char*
+library(const struct teelib* tl)
+{
+  void* fqn[] = { (void*)tl->file, (void*)tl->transfer,
+                  (void*)tl->transfer_at, (void*)tl->transfer_iov,
+                  (void*)tl->metadata, (void*)tl->region, (void*)tl->finish };
+  for(size_t i=0; i < sizeof(fqn)/sizeof(fqn[0]); ++i) {
+    Dl_info info;
+    if(fqn[i] != NULL && dladdr(fqn[i], &info) != 0 && info.dli_fname) {
+      return info.dli_fname;
+    }
+  }
+  return "?";
+}
+
+static void
+json(FILE* out, const char* reason)
+{
+  char host[256] = "?";
+  gethostname(host, sizeof(host));
+  host[sizeof(host)-1] = '\0';
+  fprintf(out, "{\"rank\": %" PRId64 ", \"pid\": %ld, \"host\": ",
+          trace_rank(), (long)getpid());
+  json_str(out, host);
+  fprintf(out, ", \"reason\": ");
+  json_str(out, reason);
+
+  fprintf(out, ",\n \"io\": {");
+  for(size_t k=0; k < IO_NKINDS; ++k) {
+    fprintf(out, "%s\n  ", k == 0 ? "" : ",");
+    json_counter(out, ionames[k], &io[k]);
+  }
+  fprintf(out, "},\n");
+
+  struct asyncstats as;
+  async_stats(&as);
+  fprintf(out, " \"async\": {\"submitted\": %zu, \"max_depth\": %zu, "
+          "\"max_bytes\": %zu, \"blocked\": %zu, \"dropped\": %zu, "
+          "\"spilled\": %zu},\n", as.submitted, as.maxdepth, as.maxbytes,
+          as.blocked, as.dropped, as.spilled);
+
+  size_t n = 0;
+  while(n < MAX_FREEPROCS && transferlibs[n].pattern) { ++n; }
+  fprintf(out, " \"processors\": [");
+  for(size_t i=0; i < n; ++i) {
+    fprintf(out, "%s\n  {\"pattern\": ", i == 0 ? "" : ",");
+    json_str(out, transferlibs[i].pattern);
+    fprintf(out, ", \"library\": ");
+    json_str(out, library(&transferlibs[i]));
+    for(size_t op=0; op < ST_NOPS; ++op) {
+      fprintf(out, ",\n   ");
+      json_counter(out, opnames[op], &procs[i][op]);
+    }
+    fprintf(out, "}");
+  }
+  fprintf(out, "],\n");
+
+  /* the same, summed over every processor with the same pattern. */
+  fprintf(out, " \"patterns\": {");
+  bool first = true;
+  for(size_t i=0; i < n; ++i) {
+    bool seen = false;
+    for(size_t j=0; j < i && !seen; ++j) {
+      seen = strcmp(transferlibs[j].pattern, transferlibs[i].pattern) == 0;
+    }
+    if(seen) {
+      continue;
+    }
+    fprintf(out, "%s\n  ", first ? "" : ",");
+    first = false;
+    json_str(out, transferlibs[i].pattern);
+    fprintf(out, ": {");
+    for(size_t op=0; op < ST_NOPS; ++op) {
+      struct counter sum = {0, 0, 0, 0};
+      for(size_t j=i; j < n; ++j) {
+        if(strcmp(transferlibs[j].pattern, transferlibs[i].pattern) != 0) {
+          continue;
+        }
+        const struct counter* c = &procs[j][op];
+        sum.calls += __atomic_load_n(&c->calls, __ATOMIC_RELAXED);
+        sum.bytes += __atomic_load_n(&c->bytes, __ATOMIC_RELAXED);
+        sum.ns += __atomic_load_n(&c->ns, __ATOMIC_RELAXED);
+        const uint64_t mx = __atomic_load_n(&c->max_ns, __ATOMIC_RELAXED);
+        sum.max_ns = mx > sum.max_ns ? mx : sum.max_ns;
+      }
+      fprintf(out, "%s\n   ", op == 0 ? "" : ",");
+      json_counter(out, opnames[op], &sum);
+    }
+    fprintf(out, "}");
+  }
+  fprintf(out, "}}\n");
+}
+
+static bool
+write_file(const char* fn, const char* buf, size_t n)
+{
+  const int fd = trace_raw_open(fn, O_WRONLY | O_CREAT | O_TRUNC);
+  if(fd == -1) {
+    return false;
+  }
+  const bool ok = trace_raw_write(fd, buf, n);
+  syscall(SYS_close, fd);
+  return ok;
+}
+
+void
+stats_dump(const char* reason)
+{
+  if(!stats_on) {
+    return;
+  }
+  char* text = NULL;
+  size_t len = 0;
+  FILE* out = open_memstream(&text, &len);
+  if(out == NULL) {
+    return;
+  }
+  pthread_mutex_lock(&dump_lock);
+  json(out, reason);
+  fclose(out);
+  /* readers never see half a file: write it aside, then move it in place. */
+  char fn[4096], tmp[4096+16];
+  const int64_t rank = trace_rank();
+  if(rank >= 0) {
+    snprintf(fn, sizeof(fn), "%s.%" PRId64 ".json", prefix, rank);
+  } else {
+    snprintf(fn, sizeof(fn), "%s.%ld.json", prefix, (long)getpid());
+  }
+  snprintf(tmp, sizeof(tmp), "%s.%ld.tmp", fn, (long)getpid());
+  if(!write_file(tmp, text, len) || rename(tmp, fn) != 0) {
+    WARN(stats, "could not write counters to %s: %d", fn, errno);
+    unlink(tmp);
+  }
+  pthread_mutex_unlock(&dump_lock);
+  free(text);
+}
+
+static void
+wake(int sig)
+{
+  (void)sig;
+  const int e = errno;
+  sem_post(&wakeup);
+  errno = e;
+}
+
+static void*
+listener(void* arg)
+{
+  (void)arg;
+  while(true) {
+    while(sem_wait(&wakeup) == -1 && errno == EINTR) { ; }
+    if(__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+      return NULL;
+    }
+    stats_dump("signal");
+  }
+}
+
+/* "USR1", "SIGUSR1", a number, or "none". */
+static int
+parse_signal(const char* s)
+{
+  if(s == NULL || *s == '\0') {
+    return SIGUSR2;
+  }
+  if(strncmp(s, "SIG", 3) == 0) {
+    s += 3;
+  }
+  const struct { const char* name; int sig; } names[] = {
+    {"USR1", SIGUSR1}, {"USR2", SIGUSR2}, {"HUP", SIGHUP},
+    {"PROF", SIGPROF}, {"none", 0},
+  };
+  for(size_t i=0; i < sizeof(names)/sizeof(names[0]); ++i) {
+    if(strcasecmp(s, names[i].name) == 0) {
+      return names[i].sig;
+    }
+  }
+  return atoi(s);
+}
+
+/* a forked child has counters of its own, and no listener. */
+static void
+forked_child()
+{
+  memset(procs, 0, sizeof(procs));
+  memset(io, 0, sizeof(io));
+  listening = false;
+  pthread_mutex_init(&dump_lock, NULL);
+}
+
+__attribute__((constructor(102))) static void
+stats_init()
+{
+  const char* p = getenv("LIBSITU_STATS");
+  if(p == NULL || *p == '\0') {
+    return;
+  }
+  prefix = strdup(p);
+  stats_on = prefix != NULL;
+  pthread_atfork(NULL, NULL, forked_child);
+
+  const int sig = parse_signal(getenv("LIBSITU_STATS_SIGNAL"));
+  if(sig <= 0 || sig >= NSIG) {
+    return;
+  }
+  /* the program's own handler wins. */
+  struct sigaction old;
+  if(sigaction(sig, NULL, &old) != 0 || old.sa_handler != SIG_DFL) {
+    WARN(stats, "signal %d is taken; counters are only written at exit.", sig);
+    return;
+  }
+  if(sem_init(&wakeup, 0, 0) != 0) {
+    return;
+  }
+  /* the listener blocks everything, so signals go to the program's threads
+   * as they would without us. */
+  sigset_t all, prev;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &prev);
+  listening = pthread_create(&dumper, NULL, listener, NULL) == 0;
+  pthread_sigmask(SIG_SETMASK, &prev, NULL);
+  if(!listening) {
+    return;
+  }
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = wake;
+  sa.sa_flags = SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  sigaction(sig, &sa, NULL);
+  TRACE(stats, "counting into %s; dumping on signal %d", prefix, sig);
+}
+
+void
+stats_shutdown()
+{
+  if(!listening) {
+    return;
+  }
+  __atomic_store_n(&stopping, true, __ATOMIC_RELEASE);
+  sem_post(&wakeup);
+  pthread_join(dumper, NULL);
+  listening = false;
+}
@@ -0,0 +1,48 @@
+/* Performance counters.  With LIBSITU_STATS=<prefix> in the environment we
+ * count, for every processor (i.e. each pattern/library pair in situ.cfg):
+ * calls to its exec, metadata, region and finish functions, the bytes handed
+ * to exec, and the total and longest time spent inside each.  For each
+ * interposer we count the writes to files we track, their bytes, and the time
+ * spent in the real write call.
+ *
+ * The counters are written as JSON to <prefix>.<rank>.json (or .<pid>.json
+ * outside of MPI) when the program exits, and whenever the process gets
+ * LIBSITU_STATS_SIGNAL (SIGUSR2 by default), so one can look at a job that
+ * seems stuck.  Without LIBSITU_STATS, the only cost is a branch per call. */
+#ifndef FREEPROC_STATS_H
+#define FREEPROC_STATS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "fproc.h"
+
+/* what a processor was asked to do. */
+enum StatOp { ST_EXEC=0, ST_METADATA, ST_REGION, ST_FINISH, ST_NOPS };
+/* where a write came in. */
+enum StatIO { IO_POSIX=0, IO_STDIO, IO_MPIIO, IO_HDF5, IO_NKINDS };
+
+/* for internal use; see stats_start. */
+extern bool stats_on;
+uint64_t stats_now(void);
+
+/** @returns the time, to pass to the functions below when the thing being
+ * timed is done; or 0 if we aren't counting, which they ignore. */
+static inline uint64_t
+stats_start(void)
+{
+  return __builtin_expect(stats_on, 0) ? stats_now() : 0;
+}
+/** counts a call to one of tl's functions that began at 't0'.  'bytes' is
+ * only meaningful for ST_EXEC. */
+void stats_processor(const struct teelib* tl, enum StatOp, uint64_t t0,
+                     size_t bytes);
+/** counts a real write, begun at 't0', that wrote 'bytes'. */
+void stats_io(enum StatIO, uint64_t t0, size_t bytes);
+
+/** stops listening for the signal.  the counters keep counting. */
+void stats_shutdown(void);
+/** writes out the counters now; 'reason' goes in the output. */
+void stats_dump(const char* reason);
+
+#endif
@@ -1,31 +1,39 @@
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/inotify.h>
 #include <unistd.h>
 #include "debug.h"
 #include "modified.h"
 
 DECLARE_CHANNEL(tst);
-static watch* wtch = NULL;
 
 int
 main(int argc, char* argv[])
 {
-  if(argc != 2) {
-    ERR(tst, "need arg: filename to watch\n");
+  if(argc < 2) {
+    ERR(tst, "need arg(s): filename(s) to watch\n");
     return EXIT_FAILURE;
   }
-  wtch = Watch(argv[1]);
-  if(NULL == wtch) {
-    ERR(tst, "could not create watch of %s: %d\n", argv[1], errno);
+  struct watcher* w = watcher_create(0);
+  if(NULL == w) {
+    ERR(tst, "could not create watcher: %d\n", errno);
     return EXIT_FAILURE;
   }
+  for(int i=1; i < argc; ++i) {
+    if(watcher_add(w, argv[i], argv[i]) == -1) {
+      ERR(tst, "could not create watch of %s: %d\n", argv[i], errno);
+      return EXIT_FAILURE;
+    }
+  }
   do {
-    if(Modified(wtch)) {
-      printf("%s modified.\n", argv[1]);
+    struct watchevent ev[16];
+    const ssize_t n = watcher_wait(w, ev, 16, -1);
+    for(ssize_t i=0; i < n; ++i) {
+      printf("%s %s.\n", (const char*)ev[i].data,
+             ev[i].mask & IN_IGNORED ? "no longer watched" : "modified");
     }
-    sleep(2);
   } while(1);
-  Unwatch(wtch);
+  watcher_destroy(w);
   return EXIT_SUCCESS;
 }
@@ -0,0 +1,297 @@
+/* Binary traces; see trace.h. */
+#define _GNU_SOURCE 1
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#include "debug.h"
+#include "trace.h"
+
+int
+trace_raw_open(const char* fn, int flags)
+{
+  return (int)syscall(SYS_openat, AT_FDCWD, fn, flags | O_CLOEXEC, 0644);
+}
+
+bool
+trace_raw_write(int fd, const char* buf, size_t n)
+{
+  while(n > 0) {
+    const long w = syscall(SYS_write, fd, buf, n);
+    if(w == -1 && errno == EINTR) {
+      continue;
+    }
+    if(w <= 0) {
+      return false;
+    }
+    buf += w;
+    n -= (size_t)w;
+  }
+  return true;
+}
+
+_Static_assert(sizeof(((struct symbsite*)0)->kinds) == TRACE_NARGS,
+               "debug.h must keep room for every argument we record");
+
+struct ring {
+  struct trace_header* hdr;
+  struct trace_record* rec;
+  uint64_t head;
+};
+/* the prefix for our files, or NULL if we're not tracing. */
+static char* prefix = NULL;
+static size_t ringbytes = 4U << 20;
+/* bumped in forked children, so threads notice their ring is the parent's. */
+static unsigned epoch = 1;
+static __thread struct ring* myring = NULL;
+static __thread unsigned myepoch = 0;
+static struct ring noring = { NULL, NULL, 0 }; /* we failed to make one */
+static int64_t rank = -1;
+static int64_t lineage[TRACE_LINEAGE] = {0};
+
+/* call sites get their ids, and are written out, under this lock. */
+static pthread_mutex_t sites_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned nextsite = 1;
+static int sitesfd = -1;
+
+static void
+forked_child()
+{
+  memmove(lineage+1, lineage, sizeof(lineage) - sizeof(lineage[0]));
+  lineage[0] = (int64_t)getppid();
+  sitesfd = -1; /* the parent's; we need our own. */
+  pthread_mutex_init(&sites_lock, NULL);
+  ++epoch;
+}
+
+__attribute__((constructor(101))) static void
+trace_init()
+{
+  const char* rankvars[] = { "OMPI_COMM_WORLD_RANK", "PMIX_RANK", "PMI_RANK",
+                             "MV2_COMM_WORLD_RANK", "SLURM_PROCID", NULL };
+  for(const char** v=rankvars; *v; ++v) {
+    if(getenv(*v) != NULL) {
+      rank = strtoll(getenv(*v), NULL, 10);
+      break;
+    }
+  }
+  const char* p = getenv("LIBSITU_TRACE");
+  if(p == NULL || *p == '\0') {
+    return;
+  }
+  prefix = strdup(p);
+  const char* sz = getenv("LIBSITU_TRACE_SIZE");
+  if(sz != NULL && strtoul(sz, NULL, 10) >= 4096) {
+    ringbytes = strtoul(sz, NULL, 10);
+  }
+  pthread_atfork(NULL, NULL, forked_child);
+}
+
+int64_t
+trace_rank()
+{
+  return rank;
+}
+
+bool
+trace_on()
+{
+  return prefix != NULL;
+}
+
+unsigned
+trace_parse(const char* fmt, unsigned char kinds[TRACE_NARGS])
+{
+  unsigned n = 0;
+  for(const char* f=strchr(fmt, '%'); f != NULL && n < TRACE_NARGS;
+      f=strchr(f, '%')) {
+    ++f;
+    if(*f == '%') { ++f; continue; }
+    f += strspn(f, "#0- +'"); /* flags */
+    for(int wp=0; wp < 2; ++wp) { /* width, then precision */
+      if(*f == '*') {
+        kinds[n++] = TA_WIDTH;
+        ++f;
+        if(n == TRACE_NARGS) { return n; }
+      } else {
+        f += strspn(f, "0123456789");
+      }
+      if(wp == 0 && *f == '.') { ++f; } else { break; }
+    }
+    enum TraceArg integral = TA_INT;
+    bool ldouble = false;
+    switch(*f) {
+      case 'h': f += f[1] == 'h' ? 2 : 1; break;
+      case 'l':
+        integral = f[1] == 'l' ? TA_LLONG : TA_LONG;
+        f += f[1] == 'l' ? 2 : 1;
+        break;
+      case 'q': integral = TA_LLONG; ++f; break;
+      case 'L': ldouble = true; ++f; break;
+      case 'z': integral = TA_SIZE; ++f; break;
+      case 'j': integral = TA_INTMAX; ++f; break;
+      case 't': integral = TA_PTRDIFF; ++f; break;
+    }
+    switch(*f) {
+      case 'd': case 'i': case 'u': case 'x': case 'X': case 'o': case 'c':
+        kinds[n++] = (unsigned char)integral;
+        break;
+      case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a':
+      case 'A':
+        kinds[n++] = ldouble ? TA_LDOUBLE : TA_DOUBLE;
+        break;
+      case 'p': kinds[n++] = TA_PTR; break;
+      case 's': kinds[n++] = TA_STR; break;
+      default: return n; /* something we don't understand; stop here. */
+    }
+  }
+  return n;
+}
+
+/* writes 's' to the sites file, escaping tabs, newlines and backslashes. */
+static void
+escaped(char* out, size_t* len, size_t cap, const char* s)
+{
+  for(; *s && *len+2 < cap; ++s) {
+    const char esc = *s == '\t' ? 't' : *s == '\n' ? 'n' : *s == '\\' ? '\\' : 0;
+    if(esc) {
+      out[(*len)++] = '\\';
+      out[(*len)++] = esc;
+    } else {
+      out[(*len)++] = *s;
+    }
+  }
+}
+
+/* gives 'site' an id and writes it out.  needs sites_lock. */
+static void
+register_site(struct symbsite* site, const char* chname)
+{
+  if(sitesfd == -1) {
+    char fn[4096];
+    snprintf(fn, sizeof(fn), "%s.%ld.sites", prefix, (long)getpid());
+    sitesfd = trace_raw_open(fn, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND);
+    if(sitesfd == -1) {
+      sitesfd = -2; /* don't try again. */
+    }
+  }
+  const unsigned id = nextsite++;
+  site->nargs = (unsigned char)trace_parse(site->fmt, site->kinds);
+  if(sitesfd >= 0) {
+    /* id, channel, function, format; one line each. */
+    char line[2048];
+    size_t len = (size_t)snprintf(line, sizeof(line), "%u\t", id);
+    escaped(line, &len, sizeof(line)-4, chname);
+    line[len++] = '\t';
+    escaped(line, &len, sizeof(line)-3, site->func);
+    line[len++] = '\t';
+    escaped(line, &len, sizeof(line)-2, site->fmt);
+    line[len++] = '\n';
+    trace_raw_write(sitesfd, line, len);
+  }
+  __atomic_store_n(&site->id, id, __ATOMIC_RELEASE);
+}
+
+static struct ring*
+ring_open()
+{
+  struct ring* r = calloc(1, sizeof(struct ring));
+  if(r == NULL) {
+    return &noring;
+  }
+  const size_t cap = (ringbytes - sizeof(struct trace_header)) /
+                     sizeof(struct trace_record);
+  const size_t bytes = sizeof(struct trace_header) +
+                       cap*sizeof(struct trace_record);
+  const long tid = syscall(SYS_gettid);
+  char fn[4096];
+  snprintf(fn, sizeof(fn), "%s.%ld.%ld.trc", prefix, (long)getpid(), tid);
+  const int fd = trace_raw_open(fn, O_RDWR | O_CREAT | O_TRUNC);
+  void* mem = MAP_FAILED;
+  if(fd != -1 && ftruncate(fd, (off_t)bytes) == 0) {
+    mem = mmap(NULL, bytes, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+  if(fd != -1) {
+    syscall(SYS_close, fd);
+  }
+  if(mem == MAP_FAILED) {
+    free(r);
+    return &noring;
+  }
+  r->hdr = mem;
+  r->rec = (struct trace_record*)(r->hdr+1);
+  memcpy(r->hdr->magic, TRACE_MAGIC, sizeof(r->hdr->magic));
+  r->hdr->recsize = sizeof(struct trace_record);
+  r->hdr->cap = (uint32_t)cap;
+  r->hdr->pid = (int64_t)getpid();
+  r->hdr->tid = (int64_t)tid;
+  r->hdr->rank = rank;
+  memcpy(r->hdr->lineage, lineage, sizeof(lineage));
+  return r;
+}
+
+void
+trace_put(struct symbsite* site, const char* chname, va_list args)
+{
+  if(myring == NULL || myepoch != epoch) {
+    myring = ring_open();
+    myepoch = epoch;
+  }
+  struct ring* r = myring;
+  if(r == &noring) {
+    return;
+  }
+  if(__atomic_load_n(&site->id, __ATOMIC_ACQUIRE) == 0) {
+    pthread_mutex_lock(&sites_lock);
+    if(site->id == 0) {
+      register_site(site, chname);
+    }
+    pthread_mutex_unlock(&sites_lock);
+  }
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  struct trace_record* rec = &r->rec[r->head % r->hdr->cap];
+  rec->ns = (uint64_t)ts.tv_sec*1000000000ULL + (uint64_t)ts.tv_nsec;
+  rec->site = site->id;
+  rec->cls = (uint8_t)site->cls;
+  rec->nargs = site->nargs;
+  for(unsigned i=0; i < site->nargs; ++i) {
+    uint64_t v = 0;
+    switch((enum TraceArg)site->kinds[i]) {
+      case TA_INT: case TA_WIDTH: v = (uint64_t)va_arg(args, int); break;
+      case TA_LONG: v = (uint64_t)va_arg(args, long); break;
+      case TA_LLONG: v = (uint64_t)va_arg(args, long long); break;
+      case TA_SIZE: v = (uint64_t)va_arg(args, size_t); break;
+      case TA_INTMAX: v = (uint64_t)va_arg(args, intmax_t); break;
+      case TA_PTRDIFF: v = (uint64_t)va_arg(args, ptrdiff_t); break;
+      case TA_DOUBLE: {
+        const double d = va_arg(args, double);
+        memcpy(&v, &d, sizeof(v));
+        break;
+      }
+      case TA_LDOUBLE: {
+        const double d = (double)va_arg(args, long double);
+        memcpy(&v, &d, sizeof(v));
+        break;
+      }
+      case TA_PTR: v = (uint64_t)(uintptr_t)va_arg(args, void*); break;
+      case TA_STR: {
+        const char* s = va_arg(args, const char*);
+        if(s != NULL) {
+          memcpy(&v, s, strnlen(s, sizeof(v)));
+        }
+        break;
+      }
+    }
+    rec->args[i] = v;
+  }
+  /* the record is complete before it is counted. */
+  __atomic_store_n(&r->hdr->head, ++r->head, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,79 @@
+/* Binary traces.  With LIBSITU_TRACE=<prefix> in the environment, enabled
+ * debug messages (see debug.h) are not printed.  Instead each is stored as a
+ * fixed-size record in a ring buffer: a timestamp, the call site, and the
+ * first few arguments, unformatted.  Every thread has its own ring, which is a
+ * shared mapping of the file
+ *
+ *   <prefix>.<pid>.<tid>.trc
+ *
+ * so recording takes no locks and no system calls, and the records survive
+ * the process crashing.  When a ring is full, the oldest records are
+ * overwritten.  The call sites---channel, function and format string---are
+ * written out once each, the first time they are hit, to
+ *
+ *   <prefix>.<pid>.sites
+ *
+ * 'situtrace' turns a set of these files, e.g. from all ranks of a job, into
+ * one timeline.  Errors and warnings are still printed as well. */
+#ifndef FREEPROC_TRACE_H
+#define FREEPROC_TRACE_H
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define TRACE_MAGIC "SITUTRC1"
+#define TRACE_NARGS 6U
+#define TRACE_LINEAGE 10U
+
+/* the start of a .trc file. */
+struct trace_header {
+  char magic[8];
+  uint32_t recsize; /* sizeof(struct trace_record) */
+  uint32_t cap; /* records in the ring */
+  uint64_t head; /* records ever written; the newest is at (head-1)%cap */
+  int64_t pid;
+  int64_t tid;
+  int64_t rank; /* MPI rank, from the launcher's environment; or -1 */
+  /* processes we were forked from, nearest first, 0-terminated.  call sites
+   * they registered before the fork are in their .sites files, not ours. */
+  int64_t lineage[TRACE_LINEAGE];
+};
+struct trace_record {
+  uint64_t ns; /* CLOCK_REALTIME */
+  uint32_t site;
+  uint8_t cls; /* enum SymbiontChanClass */
+  uint8_t nargs;
+  uint8_t pad[2];
+  /* integers and pointers as they are; doubles' bits; for strings, the first
+   * 8 bytes. */
+  uint64_t args[TRACE_NARGS];
+};
+
+/* what an argument was passed as. */
+enum TraceArg {
+  TA_INT=0, TA_LONG, TA_LLONG, TA_SIZE, TA_INTMAX, TA_PTRDIFF,
+  TA_DOUBLE, TA_LDOUBLE, TA_PTR, TA_STR,
+  TA_WIDTH, /* an int given for a '*' width or precision */
+};
+/** works out the types of the first (up to) TRACE_NARGS arguments 'fmt'
+ * takes.  @returns how many it found. */
+unsigned trace_parse(const char* fmt, unsigned char kinds[TRACE_NARGS]);
+
+/* open(2) and write(2), as system calls of our own.  we are part of the
+ * library that interposes open and write, and our own files must never be
+ * handed to processors.  trace_raw_open adds O_CLOEXEC and mode 0644.
+ * trace_raw_write @returns false if it could not write everything. */
+int trace_raw_open(const char* fn, int flags);
+bool trace_raw_write(int fd, const char* buf, size_t n);
+
+/** @returns our MPI rank, as the launcher's environment gives it, or -1. */
+int64_t trace_rank(void);
+
+struct symbsite;
+/** are we recording binary traces? */
+bool trace_on(void);
+/** records a message from 'site' on channel 'chname'. */
+void trace_put(struct symbsite* site, const char* chname, va_list args);
+
+#endif
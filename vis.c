@@ -8,6 +8,7 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
+#include "spawner.h"
 #include "vis.h"
 
 #ifndef NDEBUG
@@ -25,28 +26,6 @@ ignore_children()
   sigaction(SIGCLD, &nocld, NULL);
 }
 
-/* get rid of all the environment variables we don't *need* to run. */
-static void
-simplify_env()
-{
-  unsetenv("LD_PRELOAD");
-  const char* home = getenv("HOME");
-  const char* path = getenv("PATH");
-  const char* display = getenv("DISPLAY");
-  if(clearenv() != 0) {
-    fprintf(stderr, "Could not clear environment..");
-  }
-  if(setenv("PATH", path, 1) != 0) {
-    fprintf(stderr, "setenv PATH failed.\n");
-  }
-  if(setenv("HOME", home, 1) != 0) {
-    fprintf(stderr, "setenv HOME failed.\n");
-  }
-  if(display && setenv("DISPLAY", display, 1) != 0) {
-    fprintf(stderr, "setenv DISPLAY failed.\n");
-  }
-}
-
 static void reap();
 static void reap_sync(pid_t);
 typedef void (ryecatch)(pid_t);
@@ -123,28 +102,21 @@ launch_vis(const char* filename, FILE* log)
   if(pv == NULL) { pv = "/usr/bin/pvbatch"; }
   LOG("[%d] using '%s' for pvbatch\n", (int)getpid(), pv);
 
-  /* We fix our environment in the child, but at the very least we want to stop
-   * tracing opens/closes for the vis process (otherwise its turtles all the
-   * way down...) */
-  unsetenv("LD_PRELOAD");
   /* ignore children exiting, but not if we're synchronous---then we need to
    * track children so we can grab e.g. their exit status, later. */
   if(getenv("LIBSITU_SYNC") == NULL) {
     ignore_children(); /* attempt to ignore children, to prevent zombies. */
   }
-  pid_t pid = fork();
   /* Restrictions in OMPI mean that, after a fork, we can't assume any pages
-   * are writable!  This basically means we must immediately exec.  Hence why
-   * we fixed our environment up front. */
+   * are writable!  So we don't fork: the child borrows our memory until it
+   * execs, and its environment is ready before it starts. */
+  char** env = minimal_env(NULL);
+  char* argv[] = { (char*)pv, "--use-offscreen-rendering", "batch.py", "-f",
+                   (char*)filename, "-g", NULL };
+  const pid_t pid = env ? spawn(argv, env, false) : -1;
+  free_env(env);
   if(pid == -1) {
-    LOG("Could not fork vis process: %d\n", errno);
-    return;
-  }
-  if(pid == 0) {
-    simplify_env();
-    execl(pv, pv, "--use-offscreen-rendering", "batch.py", "-f", filename, "-g",
-          NULL);
-    LOG("could not exec pvbatch: %d\n", errno);
+    LOG("Could not start vis process: %d\n", errno);
     return;
   }
   /* This is joyful.  As sigaction(2) says: